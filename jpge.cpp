@@ -27,23 +27,133 @@
 //                       Code tweaks to fix VS2008 static code analysis warnings (all looked harmless).
 //                       Code review revealed method load_block_16_8_8() (used for the non-default H2V1 sampling mode to downsample chroma) somehow didn't get the rounding factor fix from v1.02.
 // v1.05, March 25, 2020: Added Apache 2.0 alternate license
+//
+// Important:
+// #define JPGE_USE_SSE2 to 0 to completely disable SSE2 usage, or JPGE_USE_AVX2 to 0 to disable AVX2 usage.
+// AVX2 code is only used if the CPU supports it at run time.
+//
 
 #include "jpge.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <malloc.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 #define JPGE_MAX(a,b) (((a)>(b))?(a):(b))
 #define JPGE_MIN(a,b) (((a)<(b))?(a):(b))
 
+#ifndef JPGE_USE_SSE2
+
+	#if defined(__GNUC__)
+		#if defined(__SSE2__)
+			#define JPGE_USE_SSE2 (1)
+		#endif
+	#elif defined(_MSC_VER)
+		#if defined(_M_X64)
+			#define JPGE_USE_SSE2 (1)
+		#endif
+	#endif
+
+#endif
+
+#ifndef JPGE_USE_AVX2
+
+	#if JPGE_USE_SSE2 && (defined(__x86_64__) || defined(_M_X64))
+		#define JPGE_USE_AVX2 (1)
+	#endif
+
+#endif
+
+#if JPGE_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#if JPGE_USE_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#define JPGE_AVX2_FUNC
+#else
+#define JPGE_AVX2_FUNC __attribute__((target("avx2")))
+#endif
+#endif
+
 namespace jpge {
 
 	static inline void* jpge_malloc(size_t nSize) { return malloc(nSize); }
 	static inline void jpge_free(void* p) { free(p); }
+	static inline void* jpge_realloc(void* p, size_t nSize) { return realloc(p, nSize); }
+
+	// Growable memory stream, holding the unstuffed entropy coded data of a band of MCU rows, or cached coefficients.
+	class band_stream : public output_stream
+	{
+		band_stream(const band_stream&);
+		band_stream& operator= (const band_stream&);
+
+		uint8* m_pBuf;
+		uint m_buf_size, m_buf_ofs;
+
+	public:
+		band_stream() : m_pBuf(NULL), m_buf_size(0), m_buf_ofs(0) { }
+
+		virtual ~band_stream() { jpge_free(m_pBuf); }
+
+		virtual bool put_buf(const void* pBuf, int len)
+		{
+			uint8* pDst = append(len);
+			if (!pDst)
+				return false;
+			memcpy(pDst, pBuf, len);
+			return true;
+		}
+
+		// Grows the stream by len bytes, and returns a pointer to them (NULL on out of memory).
+		uint8* append(uint len)
+		{
+			if (m_buf_ofs + len > m_buf_size)
+			{
+				const uint new_size = JPGE_MAX(JPGE_MAX(m_buf_size * 2, m_buf_ofs + len), 4096U);
+				uint8* pNew_buf = static_cast<uint8*>(jpge_realloc(m_pBuf, new_size));
+				if (!pNew_buf)
+					return NULL;
+				m_pBuf = pNew_buf;
+				m_buf_size = new_size;
+			}
+			m_buf_ofs += len;
+			return m_pBuf + m_buf_ofs - len;
+		}
+
+		virtual uint8* get_write_buffer(uint min_size, uint& size)
+		{
+			if (!append(min_size))
+				return NULL;
+			m_buf_ofs -= min_size;
+			size = m_buf_size - m_buf_ofs;
+			return m_pBuf + m_buf_ofs;
+		}
+
+		virtual bool commit(uint size)
+		{
+			m_buf_ofs += size;
+			return true;
+		}
+
+		const uint8* get_buf() const { return m_pBuf; }
+		uint get_size() const { return m_buf_ofs; }
+
+		// Empties the stream, keeping its buffer.
+		void reset() { m_buf_ofs = 0; }
+	};
 
 	// Various JPEG enums and tables.
-	enum { M_SOF0 = 0xC0, M_DHT = 0xC4, M_SOI = 0xD8, M_EOI = 0xD9, M_SOS = 0xDA, M_DQT = 0xDB, M_APP0 = 0xE0 };
+	enum { M_SOF0 = 0xC0, M_SOF2 = 0xC2, M_DHT = 0xC4, M_RST0 = 0xD0, M_SOI = 0xD8, M_EOI = 0xD9, M_SOS = 0xDA, M_DQT = 0xDB, M_DRI = 0xDD, M_APP0 = 0xE0 };
 	enum { DC_LUM_CODES = 12, AC_LUM_CODES = 256, DC_CHROMA_CODES = 12, AC_CHROMA_CODES = 256, MAX_HUFF_SYMBOLS = 257, MAX_HUFF_CODESIZE = 32 };
 
 	static uint8 s_zag[64] = { 0,1,8,16,9,2,3,10,17,24,32,25,18,11,4,5,12,19,26,33,40,48,41,34,27,20,13,6,7,14,21,28,35,42,49,56,57,50,43,36,29,22,15,23,30,37,44,51,58,59,52,45,38,31,39,46,53,60,61,54,47,55,62,63 };
@@ -79,6 +189,31 @@ namespace jpge {
 	  0xf9,0xfa
 	};
 
+	// The default progressive scan scripts, the same as libjpeg's jpeg_simple_progression(): the DC coefficients first,
+	// then the low and high frequency AC coefficients of luma, with the least significant bit of everything refined last.
+	static const scan_info s_progressive_y_scans[] =
+	{
+		{ 1, { 0, 0, 0 }, 0, 0, 0, 1 },
+		{ 1, { 0, 0, 0 }, 1, 5, 0, 2 },
+		{ 1, { 0, 0, 0 }, 6, 63, 0, 2 },
+		{ 1, { 0, 0, 0 }, 1, 63, 2, 1 },
+		{ 1, { 0, 0, 0 }, 0, 0, 1, 0 },
+		{ 1, { 0, 0, 0 }, 1, 63, 1, 0 }
+	};
+	static const scan_info s_progressive_ycc_scans[] =
+	{
+		{ 3, { 0, 1, 2 }, 0, 0, 0, 1 },
+		{ 1, { 0, 0, 0 }, 1, 5, 0, 2 },
+		{ 1, { 2, 0, 0 }, 1, 63, 0, 1 },
+		{ 1, { 1, 0, 0 }, 1, 63, 0, 1 },
+		{ 1, { 0, 0, 0 }, 6, 63, 0, 2 },
+		{ 1, { 0, 0, 0 }, 1, 63, 2, 1 },
+		{ 3, { 0, 1, 2 }, 0, 0, 1, 0 },
+		{ 1, { 2, 0, 0 }, 1, 63, 1, 0 },
+		{ 1, { 1, 0, 0 }, 1, 63, 1, 0 },
+		{ 1, { 0, 0, 0 }, 1, 63, 1, 0 }
+	};
+
 	// Low-level helper functions.
 	template <class T> inline void clear_obj(T& obj) { memset(&obj, 0, sizeof(obj)); }
 
@@ -90,43 +225,233 @@ namespace jpge {
 		return static_cast<int>(static_cast<uint32>(val) << bits);
 	}
 
-	static void RGB_to_YCC(uint8* pDst, const uint8* pSrc, int num_pixels)
+	// The RGB color conversion functions take BPP byte source pixels with the red, green and blue bytes at offsets R, G
+	// and B, so every byte order is converted directly, without swizzling it first. The Y, Cb and Cr samples are written
+	// to separate planes (pCb and pCr aren't used when converting to Y only).
+	template<int BPP, int R, int G, int B> static void RGB_to_YCC(uint8* pY, uint8* pCb, uint8* pCr, const uint8* pSrc, int num_pixels)
+	{
+		for (; num_pixels; pY++, pCb++, pCr++, pSrc += BPP, num_pixels--)
+		{
+			const int r = pSrc[R], g = pSrc[G], b = pSrc[B];
+			pY[0] = static_cast<uint8>((r * YR + g * YG + b * YB + 32768) >> 16);
+			pCb[0] = clamp(128 + ((r * CB_R + g * CB_G + b * CB_B + 32768) >> 16));
+			pCr[0] = clamp(128 + ((r * CR_R + g * CR_G + b * CR_B + 32768) >> 16));
+		}
+	}
+
+	template<int BPP, int R, int G, int B> static void RGB_to_Y(uint8* pY, uint8*, uint8*, const uint8* pSrc, int num_pixels)
+	{
+		for (; num_pixels; pY++, pSrc += BPP, num_pixels--)
+			pY[0] = static_cast<uint8>((pSrc[R] * YR + pSrc[G] * YG + pSrc[B] * YB + 32768) >> 16);
+	}
+
+	static void Y_to_YCC(uint8* pY, uint8* pCb, uint8* pCr, const uint8* pSrc, int num_pixels)
+	{
+		memcpy(pY, pSrc, num_pixels);
+		memset(pCb, 128, num_pixels);
+		memset(pCr, 128, num_pixels);
+	}
+
+	static void Y_to_Y(uint8* pY, uint8*, uint8*, const uint8* pSrc, int num_pixels)
+	{
+		memcpy(pY, pSrc, num_pixels);
+	}
+
+	// SIMD color conversion. These give exactly the same results as the scalar functions above: pairs of 8-bit channels
+	// are placed in the 16-bit halves of 32-bit lanes, and multiplied by pairs of the fixed point constants with pmaddwd.
+	// Constants that don't fit in 16 bits are halved, and their channel doubled (YG/2, CB_B/2, CR_R/2), and the rounding
+	// constant 32768 is folded in as 128*256. Y, Cb+128 and Cr+128 can't go below 0, and the only value above 255 is 256 for
+	// pure blue or red, so clamping is done by subtracting 1 where Cb or Cr exceeds 127.
+	// Each function converts as many pixels as possible 16 (SSE2) or 32 (AVX2) at a time, then finishes with the scalar version.
+#define JPGE_PAIR(lo, hi) ((int)(((uint)(lo) & 0xFFFFU) | ((uint)(hi) << 16U)))
+
+#if JPGE_USE_SSE2
+	// Loads 4 pixels into the 32-bit lanes of a vector (the first byte in the low byte). With 3 bytes per pixel, the last group of a run loads
+	// from 4 bytes earlier and shifts, so nothing past the run is read.
+	template<int BPP, bool LAST> static inline __m128i load_pixels_sse2(const uint8* pSrc)
+	{
+		if (BPP == 4)
+			return _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc));
+		const __m128i v = LAST ? _mm_srli_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc - 4)), 4) : _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc));
+		const __m128i a = _mm_unpacklo_epi32(v, _mm_srli_si128(v, 3));
+		const __m128i b = _mm_unpacklo_epi32(_mm_srli_si128(v, 6), _mm_srli_si128(v, 9));
+		return _mm_unpacklo_epi64(a, b);
+	}
+
+	// Returns byte OFS of each 32-bit lane.
+	template<int OFS> static inline __m128i get_channel_sse2(__m128i x)
+	{
+		return _mm_and_si128(_mm_srli_epi32(x, OFS * 8), _mm_set1_epi32(0xFF));
+	}
+
+	template<int R, int G, int B> static inline __m128i pixels_to_y_sse2(__m128i x)
+	{
+		const __m128i r = get_channel_sse2<R>(x), g = get_channel_sse2<G>(x), b = get_channel_sse2<B>(x);
+		const __m128i r_g2 = _mm_or_si128(r, _mm_slli_epi32(g, 17)), b_128 = _mm_or_si128(b, _mm_set1_epi32(128 << 16));
+		return _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(r_g2, _mm_set1_epi32(JPGE_PAIR(YR, YG / 2))), _mm_madd_epi16(b_128, _mm_set1_epi32(JPGE_PAIR(YB, 256)))), 16);
+	}
+
+	// Returns Y, Cb+128 and Cr+128 in the 32-bit lanes of y, cb and cr.
+	template<int R, int G, int B> static inline void pixels_to_ycc_sse2(__m128i x, __m128i& y, __m128i& cb, __m128i& cr)
+	{
+		const __m128i k_128 = _mm_set1_epi32(128 << 16), k_half = _mm_set1_epi32(JPGE_PAIR(CB_B / 2, 256));
+		const __m128i r = get_channel_sse2<R>(x), g = get_channel_sse2<G>(x), b = get_channel_sse2<B>(x);
+		y = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_or_si128(r, _mm_slli_epi32(g, 17)), _mm_set1_epi32(JPGE_PAIR(YR, YG / 2))), _mm_madd_epi16(_mm_or_si128(b, k_128), _mm_set1_epi32(JPGE_PAIR(YB, 256)))), 16);
+		cb = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_or_si128(r, _mm_slli_epi32(g, 16)), _mm_set1_epi32(JPGE_PAIR(CB_R, CB_G))), _mm_madd_epi16(_mm_or_si128(_mm_slli_epi32(b, 1), k_128), k_half)), 16);
+		cr = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_or_si128(_mm_slli_epi32(r, 1), k_128), k_half), _mm_madd_epi16(_mm_or_si128(g, _mm_slli_epi32(b, 16)), _mm_set1_epi32(JPGE_PAIR(CR_G, CR_B)))), 16);
+		const __m128i k_127 = _mm_set1_epi32(127), k_cbcr = _mm_set1_epi32(128);
+		cb = _mm_add_epi32(_mm_add_epi32(cb, _mm_cmpgt_epi32(cb, k_127)), k_cbcr);
+		cr = _mm_add_epi32(_mm_add_epi32(cr, _mm_cmpgt_epi32(cr, k_127)), k_cbcr);
+	}
+
+	// Packs four vectors of 32-bit lanes holding 0-255 into 16 bytes.
+	static inline __m128i pack_4x4_sse2(__m128i a, __m128i b, __m128i c, __m128i d)
+	{
+		return _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+	}
+
+	template<int BPP, int R, int G, int B> static void RGB_to_YCC_sse2(uint8* pY, uint8* pCb, uint8* pCr, const uint8* pSrc, int num_pixels)
+	{
+		for (; num_pixels >= 16; num_pixels -= 16, pSrc += 16 * BPP, pY += 16, pCb += 16, pCr += 16)
+		{
+			__m128i y[4], cb[4], cr[4];
+			pixels_to_ycc_sse2<R, G, B>(load_pixels_sse2<BPP, false>(pSrc), y[0], cb[0], cr[0]);
+			pixels_to_ycc_sse2<R, G, B>(load_pixels_sse2<BPP, false>(pSrc + 4 * BPP), y[1], cb[1], cr[1]);
+			pixels_to_ycc_sse2<R, G, B>(load_pixels_sse2<BPP, false>(pSrc + 8 * BPP), y[2], cb[2], cr[2]);
+			pixels_to_ycc_sse2<R, G, B>(load_pixels_sse2<BPP, true>(pSrc + 12 * BPP), y[3], cb[3], cr[3]);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(pY), pack_4x4_sse2(y[0], y[1], y[2], y[3]));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(pCb), pack_4x4_sse2(cb[0], cb[1], cb[2], cb[3]));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(pCr), pack_4x4_sse2(cr[0], cr[1], cr[2], cr[3]));
+		}
+		RGB_to_YCC<BPP, R, G, B>(pY, pCb, pCr, pSrc, num_pixels);
+	}
+
+	template<int BPP, int R, int G, int B> static void RGB_to_Y_sse2(uint8* pY, uint8* pCb, uint8* pCr, const uint8* pSrc, int num_pixels)
 	{
-		for (; num_pixels; pDst += 3, pSrc += 3, num_pixels--)
+		for (; num_pixels >= 16; num_pixels -= 16, pSrc += 16 * BPP, pY += 16)
 		{
-			const int r = pSrc[0], g = pSrc[1], b = pSrc[2];
-			pDst[0] = static_cast<uint8>((r * YR + g * YG + b * YB + 32768) >> 16);
-			pDst[1] = clamp(128 + ((r * CB_R + g * CB_G + b * CB_B + 32768) >> 16));
-			pDst[2] = clamp(128 + ((r * CR_R + g * CR_G + b * CR_B + 32768) >> 16));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(pY), pack_4x4_sse2(pixels_to_y_sse2<R, G, B>(load_pixels_sse2<BPP, false>(pSrc)), pixels_to_y_sse2<R, G, B>(load_pixels_sse2<BPP, false>(pSrc + 4 * BPP)),
+				pixels_to_y_sse2<R, G, B>(load_pixels_sse2<BPP, false>(pSrc + 8 * BPP)), pixels_to_y_sse2<R, G, B>(load_pixels_sse2<BPP, true>(pSrc + 12 * BPP))));
 		}
+		RGB_to_Y<BPP, R, G, B>(pY, pCb, pCr, pSrc, num_pixels);
+	}
+#endif // JPGE_USE_SSE2
+
+#if JPGE_USE_AVX2
+	static bool cpu_has_avx2()
+	{
+#ifdef _MSC_VER
+		int cpu_info[4];
+		__cpuid(cpu_info, 0);
+		if (cpu_info[0] < 7)
+			return false;
+		__cpuid(cpu_info, 1);
+		if ((((cpu_info[2] >> 27) & 3) != 3) || ((_xgetbv(0) & 6) != 6)) // OSXSAVE and AVX, and the OS saves the YMM registers
+			return false;
+		__cpuidex(cpu_info, 7, 0);
+		return ((cpu_info[1] >> 5) & 1) != 0;
+#else
+		return __builtin_cpu_supports("avx2") != 0;
+#endif
+	}
+
+	// Loads 8 pixels into the 32-bit lanes of a vector. See load_pixels_sse2().
+	template<int BPP, bool LAST> JPGE_AVX2_FUNC static inline __m256i load_pixels_avx2(const uint8* pSrc)
+	{
+		if (BPP == 4)
+			return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pSrc));
+		const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc));
+		const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc + (LAST ? 8 : 12)));
+		const __m256i shuffle = LAST ?
+			_mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1, 4, 5, 6, -1, 7, 8, 9, -1, 10, 11, 12, -1, 13, 14, 15, -1) :
+			_mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+		return _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), shuffle);
+	}
+
+	template<int OFS> JPGE_AVX2_FUNC static inline __m256i get_channel_avx2(__m256i x)
+	{
+		return _mm256_and_si256(_mm256_srli_epi32(x, OFS * 8), _mm256_set1_epi32(0xFF));
+	}
+
+	template<int R, int G, int B> JPGE_AVX2_FUNC static inline __m256i pixels_to_y_avx2(__m256i x)
+	{
+		const __m256i r = get_channel_avx2<R>(x), g = get_channel_avx2<G>(x), b = get_channel_avx2<B>(x);
+		const __m256i r_g2 = _mm256_or_si256(r, _mm256_slli_epi32(g, 17)), b_128 = _mm256_or_si256(b, _mm256_set1_epi32(128 << 16));
+		return _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(r_g2, _mm256_set1_epi32(JPGE_PAIR(YR, YG / 2))), _mm256_madd_epi16(b_128, _mm256_set1_epi32(JPGE_PAIR(YB, 256)))), 16);
+	}
+
+	// Returns Y, Cb+128 and Cr+128 in the 32-bit lanes of y, cb and cr.
+	template<int R, int G, int B> JPGE_AVX2_FUNC static inline void pixels_to_ycc_avx2(__m256i x, __m256i& y, __m256i& cb, __m256i& cr)
+	{
+		const __m256i k_128 = _mm256_set1_epi32(128 << 16), k_half = _mm256_set1_epi32(JPGE_PAIR(CB_B / 2, 256));
+		const __m256i r = get_channel_avx2<R>(x), g = get_channel_avx2<G>(x), b = get_channel_avx2<B>(x);
+		y = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(_mm256_or_si256(r, _mm256_slli_epi32(g, 17)), _mm256_set1_epi32(JPGE_PAIR(YR, YG / 2))), _mm256_madd_epi16(_mm256_or_si256(b, k_128), _mm256_set1_epi32(JPGE_PAIR(YB, 256)))), 16);
+		cb = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(_mm256_or_si256(r, _mm256_slli_epi32(g, 16)), _mm256_set1_epi32(JPGE_PAIR(CB_R, CB_G))), _mm256_madd_epi16(_mm256_or_si256(_mm256_slli_epi32(b, 1), k_128), k_half)), 16);
+		cr = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(_mm256_or_si256(_mm256_slli_epi32(r, 1), k_128), k_half), _mm256_madd_epi16(_mm256_or_si256(g, _mm256_slli_epi32(b, 16)), _mm256_set1_epi32(JPGE_PAIR(CR_G, CR_B)))), 16);
+		const __m256i k_127 = _mm256_set1_epi32(127), k_cbcr = _mm256_set1_epi32(128);
+		cb = _mm256_add_epi32(_mm256_add_epi32(cb, _mm256_cmpgt_epi32(cb, k_127)), k_cbcr);
+		cr = _mm256_add_epi32(_mm256_add_epi32(cr, _mm256_cmpgt_epi32(cr, k_127)), k_cbcr);
+	}
+
+	// Packs four vectors of 32-bit lanes holding 0-255 into 32 bytes. The packs work within 128-bit halves, so the groups
+	// of 4 lanes come out in the order 0,2,4,6,1,3,5,7 and are permuted back.
+	JPGE_AVX2_FUNC static inline __m256i pack_4x8_avx2(__m256i a, __m256i b, __m256i c, __m256i d)
+	{
+		return _mm256_permutevar8x32_epi32(_mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d)), _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
 	}
 
-	static void RGB_to_Y(uint8* pDst, const uint8* pSrc, int num_pixels)
+	template<int BPP, int R, int G, int B> JPGE_AVX2_FUNC static void RGB_to_YCC_avx2(uint8* pY, uint8* pCb, uint8* pCr, const uint8* pSrc, int num_pixels)
 	{
-		for (; num_pixels; pDst++, pSrc += 3, num_pixels--)
-			pDst[0] = static_cast<uint8>((pSrc[0] * YR + pSrc[1] * YG + pSrc[2] * YB + 32768) >> 16);
+		for (; num_pixels >= 32; num_pixels -= 32, pSrc += 32 * BPP, pY += 32, pCb += 32, pCr += 32)
+		{
+			__m256i y[4], cb[4], cr[4];
+			pixels_to_ycc_avx2<R, G, B>(load_pixels_avx2<BPP, false>(pSrc), y[0], cb[0], cr[0]);
+			pixels_to_ycc_avx2<R, G, B>(load_pixels_avx2<BPP, false>(pSrc + 8 * BPP), y[1], cb[1], cr[1]);
+			pixels_to_ycc_avx2<R, G, B>(load_pixels_avx2<BPP, false>(pSrc + 16 * BPP), y[2], cb[2], cr[2]);
+			pixels_to_ycc_avx2<R, G, B>(load_pixels_avx2<BPP, true>(pSrc + 24 * BPP), y[3], cb[3], cr[3]);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(pY), pack_4x8_avx2(y[0], y[1], y[2], y[3]));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(pCb), pack_4x8_avx2(cb[0], cb[1], cb[2], cb[3]));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(pCr), pack_4x8_avx2(cr[0], cr[1], cr[2], cr[3]));
+		}
+		RGB_to_YCC_sse2<BPP, R, G, B>(pY, pCb, pCr, pSrc, num_pixels);
 	}
 
-	static void RGBA_to_YCC(uint8* pDst, const uint8* pSrc, int num_pixels)
+	template<int BPP, int R, int G, int B> JPGE_AVX2_FUNC static void RGB_to_Y_avx2(uint8* pY, uint8* pCb, uint8* pCr, const uint8* pSrc, int num_pixels)
 	{
-		for (; num_pixels; pDst += 3, pSrc += 4, num_pixels--)
+		for (; num_pixels >= 32; num_pixels -= 32, pSrc += 32 * BPP, pY += 32)
 		{
-			const int r = pSrc[0], g = pSrc[1], b = pSrc[2];
-			pDst[0] = static_cast<uint8>((r * YR + g * YG + b * YB + 32768) >> 16);
-			pDst[1] = clamp(128 + ((r * CB_R + g * CB_G + b * CB_B + 32768) >> 16));
-			pDst[2] = clamp(128 + ((r * CR_R + g * CR_G + b * CR_B + 32768) >> 16));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(pY), pack_4x8_avx2(pixels_to_y_avx2<R, G, B>(load_pixels_avx2<BPP, false>(pSrc)), pixels_to_y_avx2<R, G, B>(load_pixels_avx2<BPP, false>(pSrc + 8 * BPP)),
+				pixels_to_y_avx2<R, G, B>(load_pixels_avx2<BPP, false>(pSrc + 16 * BPP)), pixels_to_y_avx2<R, G, B>(load_pixels_avx2<BPP, true>(pSrc + 24 * BPP))));
 		}
+		RGB_to_Y_sse2<BPP, R, G, B>(pY, pCb, pCr, pSrc, num_pixels);
 	}
+#endif // JPGE_USE_AVX2
 
-	static void RGBA_to_Y(uint8* pDst, const uint8* pSrc, int num_pixels)
+	typedef void (*color_convert_func_t)(uint8* pY, uint8* pCb, uint8* pCr, const uint8* pSrc, int num_pixels);
+
+	// Returns the fastest available function converting BPP byte pixels with the red, green and blue bytes at offsets
+	// R, G and B to YCbCr, or to Y if to_ycc is false.
+	template<int BPP, int R, int G, int B> static color_convert_func_t get_color_convert_func(bool to_ycc, bool has_sse2, bool has_avx2)
 	{
-		for (; num_pixels; pDst++, pSrc += 4, num_pixels--)
-			pDst[0] = static_cast<uint8>((pSrc[0] * YR + pSrc[1] * YG + pSrc[2] * YB + 32768) >> 16);
+#if JPGE_USE_AVX2
+		if (has_avx2)
+			return to_ycc ? RGB_to_YCC_avx2<BPP, R, G, B> : RGB_to_Y_avx2<BPP, R, G, B>;
+#else
+		(void)has_avx2;
+#endif
+#if JPGE_USE_SSE2
+		if (has_sse2)
+			return to_ycc ? RGB_to_YCC_sse2<BPP, R, G, B> : RGB_to_Y_sse2<BPP, R, G, B>;
+#else
+		(void)has_sse2;
+#endif
+		return to_ycc ? RGB_to_YCC<BPP, R, G, B> : RGB_to_Y<BPP, R, G, B>;
 	}
 
-	static void Y_to_YCC(uint8* pDst, const uint8* pSrc, int num_pixels)
+	// Returns the number of bytes per pixel of a pixel format other than PF_DEFAULT.
+	static int get_pixel_format_bpp(pixel_format_t pixel_format)
 	{
-		for (; num_pixels; pDst += 3, pSrc++, num_pixels--) { pDst[0] = pSrc[0]; pDst[1] = 128; pDst[2] = 128; }
+		return (pixel_format == PF_Y) ? 1 : (((pixel_format == PF_RGB) || (pixel_format == PF_BGR)) ? 3 : 4);
 	}
 
 	// Forward DCT - DCT derived from jfdctint.
@@ -149,25 +474,113 @@ namespace jpge {
   u3 += z5; u4 += z5; \
   s0 = t10 + t11; s1 = t7 + u1 + u4; s3 = t6 + u2 + u3; s4 = t10 - t11; s5 = t5 + u2 + u4; s7 = t4 + u1 + u3;
 
-	static void DCT2D(int32* p)
+	// The block is stored in 16-bit samples. All of the row pass results, and the final coefficients, fit in 16 bits.
+	static void DCT2D(int16* p)
 	{
-		int32 c, * q = p;
+		int32 c;
+		int16* q = p;
 		for (c = 7; c >= 0; c--, q += 8)
 		{
 			int32 s0 = q[0], s1 = q[1], s2 = q[2], s3 = q[3], s4 = q[4], s5 = q[5], s6 = q[6], s7 = q[7];
 			DCT1D(s0, s1, s2, s3, s4, s5, s6, s7);
-			q[0] = left_shifti(s0, ROW_BITS); q[1] = DCT_DESCALE(s1, CONST_BITS - ROW_BITS); q[2] = DCT_DESCALE(s2, CONST_BITS - ROW_BITS); q[3] = DCT_DESCALE(s3, CONST_BITS - ROW_BITS);
-			q[4] = left_shifti(s4, ROW_BITS); q[5] = DCT_DESCALE(s5, CONST_BITS - ROW_BITS); q[6] = DCT_DESCALE(s6, CONST_BITS - ROW_BITS); q[7] = DCT_DESCALE(s7, CONST_BITS - ROW_BITS);
+			q[0] = static_cast<int16>(left_shifti(s0, ROW_BITS)); q[1] = static_cast<int16>(DCT_DESCALE(s1, CONST_BITS - ROW_BITS)); q[2] = static_cast<int16>(DCT_DESCALE(s2, CONST_BITS - ROW_BITS)); q[3] = static_cast<int16>(DCT_DESCALE(s3, CONST_BITS - ROW_BITS));
+			q[4] = static_cast<int16>(left_shifti(s4, ROW_BITS)); q[5] = static_cast<int16>(DCT_DESCALE(s5, CONST_BITS - ROW_BITS)); q[6] = static_cast<int16>(DCT_DESCALE(s6, CONST_BITS - ROW_BITS)); q[7] = static_cast<int16>(DCT_DESCALE(s7, CONST_BITS - ROW_BITS));
 		}
 		for (q = p, c = 7; c >= 0; c--, q++)
 		{
 			int32 s0 = q[0 * 8], s1 = q[1 * 8], s2 = q[2 * 8], s3 = q[3 * 8], s4 = q[4 * 8], s5 = q[5 * 8], s6 = q[6 * 8], s7 = q[7 * 8];
 			DCT1D(s0, s1, s2, s3, s4, s5, s6, s7);
-			q[0 * 8] = DCT_DESCALE(s0, ROW_BITS + 3); q[1 * 8] = DCT_DESCALE(s1, CONST_BITS + ROW_BITS + 3); q[2 * 8] = DCT_DESCALE(s2, CONST_BITS + ROW_BITS + 3); q[3 * 8] = DCT_DESCALE(s3, CONST_BITS + ROW_BITS + 3);
-			q[4 * 8] = DCT_DESCALE(s4, ROW_BITS + 3); q[5 * 8] = DCT_DESCALE(s5, CONST_BITS + ROW_BITS + 3); q[6 * 8] = DCT_DESCALE(s6, CONST_BITS + ROW_BITS + 3); q[7 * 8] = DCT_DESCALE(s7, CONST_BITS + ROW_BITS + 3);
+			q[0 * 8] = static_cast<int16>(DCT_DESCALE(s0, ROW_BITS + 3)); q[1 * 8] = static_cast<int16>(DCT_DESCALE(s1, CONST_BITS + ROW_BITS + 3)); q[2 * 8] = static_cast<int16>(DCT_DESCALE(s2, CONST_BITS + ROW_BITS + 3)); q[3 * 8] = static_cast<int16>(DCT_DESCALE(s3, CONST_BITS + ROW_BITS + 3));
+			q[4 * 8] = static_cast<int16>(DCT_DESCALE(s4, ROW_BITS + 3)); q[5 * 8] = static_cast<int16>(DCT_DESCALE(s5, CONST_BITS + ROW_BITS + 3)); q[6 * 8] = static_cast<int16>(DCT_DESCALE(s6, CONST_BITS + ROW_BITS + 3)); q[7 * 8] = static_cast<int16>(DCT_DESCALE(s7, CONST_BITS + ROW_BITS + 3));
+		}
+	}
+
+#if JPGE_USE_SSE2
+	// SSE2 version of DCT2D(), giving exactly the same results. Each 16-bit lane holds a row of the block in the first pass,
+	// and a column in the second, so the block is transposed in registers before each pass. DCT_MUL() truncates its operand
+	// to 16 bits, so the sums feeding the multiplies can wrap, and the products are summed in pairs with pmaddwd.
+	static inline void transpose_8x8_sse2(__m128i* r)
+	{
+		const __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]), a1 = _mm_unpackhi_epi16(r[0], r[1]), a2 = _mm_unpacklo_epi16(r[2], r[3]), a3 = _mm_unpackhi_epi16(r[2], r[3]);
+		const __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]), a5 = _mm_unpackhi_epi16(r[4], r[5]), a6 = _mm_unpacklo_epi16(r[6], r[7]), a7 = _mm_unpackhi_epi16(r[6], r[7]);
+		const __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2), b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+		const __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6), b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+		r[0] = _mm_unpacklo_epi64(b0, b4); r[1] = _mm_unpackhi_epi64(b0, b4); r[2] = _mm_unpacklo_epi64(b1, b5); r[3] = _mm_unpackhi_epi64(b1, b5);
+		r[4] = _mm_unpacklo_epi64(b2, b6); r[5] = _mm_unpackhi_epi64(b2, b6); r[6] = _mm_unpacklo_epi64(b3, b7); r[7] = _mm_unpackhi_epi64(b3, b7);
+	}
+
+	// Sets lo/hi to the 32-bit values a * c0 + b * c1 of the low and high four lanes of a and b.
+	static inline void dct_madd_sse2(__m128i& lo, __m128i& hi, __m128i a, __m128i b, int c0, int c1)
+	{
+		const __m128i k = _mm_set1_epi32(JPGE_PAIR(c0, c1));
+		lo = _mm_madd_epi16(_mm_unpacklo_epi16(a, b), k);
+		hi = _mm_madd_epi16(_mm_unpackhi_epi16(a, b), k);
+	}
+
+	template<int SHIFT> static inline __m128i dct_descale_sse2(__m128i lo, __m128i hi)
+	{
+		const __m128i k_round = _mm_set1_epi32(1 << (SHIFT - 1));
+		return _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(lo, k_round), SHIFT), _mm_srai_epi32(_mm_add_epi32(hi, k_round), SHIFT));
+	}
+
+	template<bool ROWS> static inline void DCT1D_sse2(__m128i* s)
+	{
+		enum { SHIFT = ROWS ? (CONST_BITS - ROW_BITS) : (CONST_BITS + ROW_BITS + 3) };
+		const __m128i t0 = _mm_add_epi16(s[0], s[7]), t7 = _mm_sub_epi16(s[0], s[7]), t1 = _mm_add_epi16(s[1], s[6]), t6 = _mm_sub_epi16(s[1], s[6]);
+		const __m128i t2 = _mm_add_epi16(s[2], s[5]), t5 = _mm_sub_epi16(s[2], s[5]), t3 = _mm_add_epi16(s[3], s[4]), t4 = _mm_sub_epi16(s[3], s[4]);
+		const __m128i t10 = _mm_add_epi16(t0, t3), t13 = _mm_sub_epi16(t0, t3), t11 = _mm_add_epi16(t1, t2), t12 = _mm_sub_epi16(t1, t2);
+		if (ROWS)
+		{
+			s[0] = _mm_slli_epi16(_mm_add_epi16(t10, t11), ROW_BITS);
+			s[4] = _mm_slli_epi16(_mm_sub_epi16(t10, t11), ROW_BITS);
+		}
+		else
+		{
+			const __m128i k_round = _mm_set1_epi16(1 << (ROW_BITS + 2));
+			s[0] = _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(t10, t11), k_round), ROW_BITS + 3);
+			s[4] = _mm_srai_epi16(_mm_add_epi16(_mm_sub_epi16(t10, t11), k_round), ROW_BITS + 3);
 		}
+
+		__m128i lo, hi;
+		const __m128i z1 = _mm_add_epi16(t12, t13);
+		dct_madd_sse2(lo, hi, z1, t13, 4433, 6270); s[2] = dct_descale_sse2<SHIFT>(lo, hi);
+		dct_madd_sse2(lo, hi, z1, t12, 4433, -15137); s[6] = dct_descale_sse2<SHIFT>(lo, hi);
+
+		const __m128i u1 = _mm_add_epi16(t4, t7), u2 = _mm_add_epi16(t5, t6), u3 = _mm_add_epi16(t4, t6), u4 = _mm_add_epi16(t5, t7), u34 = _mm_add_epi16(u3, u4);
+		__m128i u3_lo, u3_hi, u4_lo, u4_hi;
+		dct_madd_sse2(u3_lo, u3_hi, u3, u34, -16069, 9633);
+		dct_madd_sse2(u4_lo, u4_hi, u4, u34, -3196, 9633);
+		dct_madd_sse2(lo, hi, t7, u1, 12299, -7373); s[1] = dct_descale_sse2<SHIFT>(_mm_add_epi32(lo, u4_lo), _mm_add_epi32(hi, u4_hi));
+		dct_madd_sse2(lo, hi, t6, u2, 25172, -20995); s[3] = dct_descale_sse2<SHIFT>(_mm_add_epi32(lo, u3_lo), _mm_add_epi32(hi, u3_hi));
+		dct_madd_sse2(lo, hi, t5, u2, 16819, -20995); s[5] = dct_descale_sse2<SHIFT>(_mm_add_epi32(lo, u4_lo), _mm_add_epi32(hi, u4_hi));
+		dct_madd_sse2(lo, hi, t4, u1, 2446, -7373); s[7] = dct_descale_sse2<SHIFT>(_mm_add_epi32(lo, u3_lo), _mm_add_epi32(hi, u3_hi));
+	}
+
+	static void DCT2D_sse2(int16* p)
+	{
+		__m128i r[8];
+		for (int i = 0; i < 8; i++)
+			r[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i * 8));
+		transpose_8x8_sse2(r);
+		DCT1D_sse2<true>(r);
+		transpose_8x8_sse2(r);
+		DCT1D_sse2<false>(r);
+		for (int i = 0; i < 8; i++)
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(p + i * 8), r[i]);
 	}
 
+	// Quantizes 8 coefficients with the tables from compute_quant_reciprocals(). pmulhuw by scale can't shift right by 0, so lanes
+	// with a scale of 0 keep t instead.
+	static inline __m128i quantize_sse2(__m128i x, const uint16* pRecip, const uint16* pCorr, const uint16* pScale)
+	{
+		const __m128i sign = _mm_srai_epi16(x, 15), scale = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pScale));
+		const __m128i a = _mm_add_epi16(_mm_sub_epi16(_mm_xor_si128(x, sign), sign), _mm_loadu_si128(reinterpret_cast<const __m128i*>(pCorr)));
+		const __m128i t = _mm_mulhi_epu16(a, _mm_loadu_si128(reinterpret_cast<const __m128i*>(pRecip)));
+		const __m128i r = _mm_add_epi16(_mm_mulhi_epu16(t, scale), _mm_and_si128(t, _mm_cmpeq_epi16(scale, _mm_setzero_si128())));
+		return _mm_sub_epi16(_mm_xor_si128(r, sign), sign);
+	}
+#endif // JPGE_USE_SSE2
+
 	struct sym_freq { uint m_key, m_sym_index; };
 
 	// Radix sorts sym_freq[] array by 32-bit key m_key. Returns ptr to sorted values.
@@ -243,6 +656,7 @@ namespace jpge {
 		syms0[0].m_key = 1; syms0[0].m_sym_index = 0;  // dummy symbol, assures that no valid code contains all 1's
 		int num_used_syms = 1;
 		const uint32* pSym_count = &m_huff_count[table_num][0];
+		m_std_huff_tables = false;
 		for (int i = 0; i < table_len; i++)
 			if (pSym_count[i]) { syms0[num_used_syms].m_key = pSym_count[i]; syms0[num_used_syms++].m_sym_index = i + 1; }
 		sym_freq* pSyms = radix_sort_syms(num_used_syms, syms0, syms1);
@@ -273,9 +687,21 @@ namespace jpge {
 	}
 
 	// JPEG marker generation.
+	// Markers are collected in m_header_buf, and written to the stream with flush_header().
 	void jpeg_encoder::emit_byte(uint8 i)
 	{
-		m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_obj(i);
+		if (m_header_size == JPGE_HEADER_BUF_SIZE)
+			flush_header();
+		m_header_buf[m_header_size++] = i;
+	}
+
+	// Writes out the collected markers, after any pending entropy coded data.
+	void jpeg_encoder::flush_header()
+	{
+		flush_output_buffer();
+		if (m_header_size)
+			m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(m_header_buf, m_header_size);
+		m_header_size = 0;
 	}
 
 	void jpeg_encoder::emit_word(uint i)
@@ -320,7 +746,7 @@ namespace jpge {
 	// Emit start of frame marker
 	void jpeg_encoder::emit_sof()
 	{
-		emit_marker(M_SOF0);                           /* baseline */
+		emit_marker(m_params.m_progressive_flag ? M_SOF2 : M_SOF0);
 		emit_word(3 * m_num_components + 2 + 5 + 1);
 		emit_byte(8);                                  /* precision */
 		emit_word(m_image_y);
@@ -366,33 +792,73 @@ namespace jpge {
 	}
 
 	// emit start of scan
-	void jpeg_encoder::emit_sos()
+	void jpeg_encoder::emit_sos(const scan_info& scan)
 	{
 		emit_marker(M_SOS);
-		emit_word(2 * m_num_components + 2 + 1 + 3);
-		emit_byte(m_num_components);
-		for (int i = 0; i < m_num_components; i++)
+		emit_word(2 * scan.m_num_comps + 2 + 1 + 3);
+		emit_byte(static_cast<uint8>(scan.m_num_comps));
+		for (int i = 0; i < scan.m_num_comps; i++)
 		{
-			emit_byte(static_cast<uint8>(i + 1));
-			if (i == 0)
-				emit_byte((0 << 4) + 0);
-			else
-				emit_byte((1 << 4) + 1);
+			const int c = scan.m_comp_index[i];
+			emit_byte(static_cast<uint8>(c + 1));
+			const int dc_table = ((scan.m_Ss) || (scan.m_Ah)) ? 0 : (c > 0), ac_table = (scan.m_Se) ? (c > 0) : 0; // 0 if the scan doesn't use the table
+			emit_byte(static_cast<uint8>((dc_table << 4) + ac_table));
 		}
-		emit_byte(0);     /* spectral selection */
-		emit_byte(63);
-		emit_byte(0);
+		emit_byte(static_cast<uint8>(scan.m_Ss));     /* spectral selection */
+		emit_byte(static_cast<uint8>(scan.m_Se));
+		emit_byte(static_cast<uint8>((scan.m_Ah << 4) + scan.m_Al));
+	}
+
+	// Emit define restart interval marker
+	void jpeg_encoder::emit_dri()
+	{
+		emit_marker(M_DRI);
+		emit_word(4);
+		emit_word(m_restart_interval);
 	}
 
-	// Emit all markers at beginning of image file.
+	// Emit all markers at beginning of image file. Progressive images emit their DHT and SOS markers before each scan.
+	// Emits the markers before the first scan. Unless they include optimized Huffman tables, they only depend on the
+	// image size and params, so the last ones are kept in m_header_cache and copied when the next image needs the same.
 	void jpeg_encoder::emit_markers()
+	{
+		const bool cacheable = (m_params.m_progressive_flag) || (m_std_huff_tables);
+		const int key[6] = { m_image_x, m_image_y, m_params.m_subsampling, m_quant_key, static_cast<int>(m_restart_interval), m_params.m_progressive_flag };
+		if ((cacheable) && (m_header_cache_size) && (!m_header_size) && (!memcmp(key, m_header_cache_key, sizeof(key))))
+		{
+			memcpy(m_header_buf, m_header_cache, m_header_cache_size);
+			m_header_size = m_header_cache_size;
+		}
+		else
+		{
+			const uint start = m_header_size;
+			emit_header_markers();
+			if ((cacheable) && (!start))
+			{
+				memcpy(m_header_cache, m_header_buf, m_header_size);
+				memcpy(m_header_cache_key, key, sizeof(key));
+				m_header_cache_size = m_header_size;
+			}
+		}
+		if (!m_params.m_progressive_flag)
+			flush_header();
+	}
+
+	void jpeg_encoder::emit_header_markers()
 	{
 		emit_marker(M_SOI);
 		emit_jfif_app0();
 		emit_dqt();
 		emit_sof();
-		emit_dhts();
-		emit_sos();
+		if (!m_params.m_progressive_flag)
+			emit_dhts();
+		if (m_restart_interval)
+			emit_dri();
+		if (!m_params.m_progressive_flag)
+		{
+			const scan_info scan = { m_num_components, { 0, 1, 2 }, 0, 63, 0, 0 };
+			emit_sos(scan);
+		}
 	}
 
 	// Compute the actual canonical Huffman codes/code sizes given the JPEG huff bits and val arrays.
@@ -430,13 +896,13 @@ namespace jpge {
 	}
 
 	// Quantization table generation.
-	void jpeg_encoder::compute_quant_table(int32* pDst, int16* pSrc)
+	static void compute_quant_table(int32* pDst, const int16* pSrc, int quality)
 	{
 		int32 q;
-		if (m_params.m_quality < 50)
-			q = 5000 / m_params.m_quality;
+		if (quality < 50)
+			q = 5000 / quality;
 		else
-			q = 200 - m_params.m_quality * 2;
+			q = 200 - quality * 2;
 		for (int i = 0; i < 64; i++)
 		{
 			int32 j = *pSrc++; j = (j * q + 50L) / 100L;
@@ -444,23 +910,117 @@ namespace jpge {
 		}
 	}
 
+	// Computes the luma and chroma quantization tables for the given params.
+	static void compute_quant_tables(int32 (*pTables)[64], const params& comp_params)
+	{
+		if (comp_params.m_use_std_tables)
+		{
+			compute_quant_table(pTables[0], s_std_lum_quant, comp_params.m_quality);
+			compute_quant_table(pTables[1], comp_params.m_no_chroma_discrim_flag ? s_std_lum_quant : s_std_croma_quant, comp_params.m_quality);
+		}
+		else
+		{
+			compute_quant_table(pTables[0], s_alt_quant, comp_params.m_quality);
+			memcpy(pTables[1], pTables[0], sizeof(pTables[1]));
+		}
+	}
+
+	// Computes the tables load_quantized_coefficients() uses to divide by each quantizer with multiplies. For 0 <= x <= 32768,
+	// t = ((x + corr) * recip) >> 16 followed by (t * scale) >> 16 (or just t if scale is 0) is exactly (x + q / 2) / q.
+	// Powers of 2 use recip = 1/2, other quantizers use the round-down method from Robison, "N-bit Unsigned Division via
+	// N-bit Multiply-Add".
+	void jpeg_encoder::compute_quant_reciprocals(int table_num)
+	{
+		for (int i = 0; i < 64; i++)
+		{
+			const uint q = m_quantization_tables[table_num][i];
+			uint b = 0, recip, corr = q >> 1;
+			while ((2U << b) <= q) b++;
+			if (q == 1)
+			{
+				recip = 0xFFFF; corr++; // (x + 1) * (65536 - 1) >> 16 = x
+			}
+			else if ((q & (q - 1)) == 0)
+			{
+				recip = 0x8000; b--;
+			}
+			else
+			{
+				recip = (1U << (16 + b)) / q;
+				if (((1U << (16 + b)) % q) <= (q >> 1))
+					corr++;
+				else
+					recip++;
+			}
+			m_quant_recip[table_num][i] = static_cast<uint16>(recip);
+			m_quant_corr[table_num][i] = static_cast<uint16>(corr);
+			m_quant_scale[table_num][i] = static_cast<uint16>(b ? (1U << (16 - b)) : 0);
+		}
+	}
+
+	// Returns true if pScans is a valid progressive scan script for an image with num_components components: DC scans
+	// and single component AC scans, which only refine coefficients that were already sent, and send every DC coefficient.
+	static bool check_scan_script(const scan_info* pScans, int num_scans, int num_components)
+	{
+		int last_al[3][64]; // the m_Al each coefficient was last sent with, -1 if it hasn't been sent yet
+		memset(last_al, 0xFF, sizeof(last_al));
+		for (int i = 0; i < num_scans; i++)
+		{
+			const scan_info& scan = pScans[i];
+			if ((scan.m_num_comps < 1) || (scan.m_num_comps > num_components)) return false;
+			if ((scan.m_Ss < 0) || (scan.m_Ss > scan.m_Se) || (scan.m_Se > 63)) return false;
+			if ((scan.m_Ah < 0) || (scan.m_Ah > 13) || (scan.m_Al < 0) || (scan.m_Al > 13)) return false;
+			if ((scan.m_Ss) ? (scan.m_num_comps != 1) : (scan.m_Se != 0)) return false;
+			for (int j = 0; j < scan.m_num_comps; j++)
+			{
+				const int c = scan.m_comp_index[j];
+				if ((c < 0) || (c >= num_components) || ((j) && (c <= scan.m_comp_index[j - 1]))) return false;
+				if ((scan.m_Ss) && (last_al[c][0] < 0)) return false;
+				for (int k = scan.m_Ss; k <= scan.m_Se; k++)
+				{
+					if ((scan.m_Ah) ? ((last_al[c][k] != scan.m_Ah) || (scan.m_Al != scan.m_Ah - 1)) : (last_al[c][k] >= 0)) return false;
+					last_al[c][k] = scan.m_Al;
+				}
+			}
+		}
+		for (int c = 0; c < num_components; c++)
+			if (last_al[c][0] < 0) return false;
+		return true;
+	}
+
+	// An entry of the block cache (see params::m_block_cache_size): the samples of a block, and its quantized coefficients.
+	// m_hash is hash_block() of the samples with the quantization table in its low bit. Zeroed entries are valid, since
+	// all-zero samples quantize to all-zero coefficients with either table.
+	struct jpeg_encoder::block_cache_entry
+	{
+		uint64 m_hash;
+		sample_array_t m_samples[64];
+		int16 m_coeffs[64];
+	};
+
 	// Higher-level methods.
 	void jpeg_encoder::first_pass_init()
 	{
 		m_bit_buffer = 0; m_bits_in = 0;
 		memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
 		m_mcu_y_ofs = 0;
+		m_mcu_row = 0;
 		m_pass_num = 1;
+		m_pCoeff_dst = m_pCoeffs;
+		set_restart_state(0);
 	}
 
 	bool jpeg_encoder::second_pass_init()
 	{
-		compute_huffman_table(&m_huff_codes[0 + 0][0], &m_huff_code_sizes[0 + 0][0], m_huff_bits[0 + 0], m_huff_val[0 + 0]);
-		compute_huffman_table(&m_huff_codes[2 + 0][0], &m_huff_code_sizes[2 + 0][0], m_huff_bits[2 + 0], m_huff_val[2 + 0]);
-		if (m_num_components > 1)
+		if (!m_std_huff_tables)
 		{
-			compute_huffman_table(&m_huff_codes[0 + 1][0], &m_huff_code_sizes[0 + 1][0], m_huff_bits[0 + 1], m_huff_val[0 + 1]);
-			compute_huffman_table(&m_huff_codes[2 + 1][0], &m_huff_code_sizes[2 + 1][0], m_huff_bits[2 + 1], m_huff_val[2 + 1]);
+			compute_huffman_table(&m_huff_codes[0 + 0][0], &m_huff_code_sizes[0 + 0][0], m_huff_bits[0 + 0], m_huff_val[0 + 0]);
+			compute_huffman_table(&m_huff_codes[2 + 0][0], &m_huff_code_sizes[2 + 0][0], m_huff_bits[2 + 0], m_huff_val[2 + 0]);
+			if (m_num_components > 1)
+			{
+				compute_huffman_table(&m_huff_codes[0 + 1][0], &m_huff_code_sizes[0 + 1][0], m_huff_bits[0 + 1], m_huff_val[0 + 1]);
+				compute_huffman_table(&m_huff_codes[2 + 1][0], &m_huff_code_sizes[2 + 1][0], m_huff_bits[2 + 1], m_huff_val[2 + 1]);
+			}
 		}
 		first_pass_init();
 		emit_markers();
@@ -478,6 +1038,7 @@ namespace jpge {
 			m_num_components = 1;
 			m_comp_h_samp[0] = 1; m_comp_v_samp[0] = 1;
 			m_mcu_x = 8; m_mcu_y = 8;
+			select_code_mcus<Y_ONLY>();
 			break;
 		}
 		case H1V1:
@@ -486,6 +1047,7 @@ namespace jpge {
 			m_comp_h_samp[1] = 1; m_comp_v_samp[1] = 1;
 			m_comp_h_samp[2] = 1; m_comp_v_samp[2] = 1;
 			m_mcu_x = 8; m_mcu_y = 8;
+			select_code_mcus<H1V1>();
 			break;
 		}
 		case H2V1:
@@ -494,6 +1056,7 @@ namespace jpge {
 			m_comp_h_samp[1] = 1; m_comp_v_samp[1] = 1;
 			m_comp_h_samp[2] = 1; m_comp_v_samp[2] = 1;
 			m_mcu_x = 16; m_mcu_y = 8;
+			select_code_mcus<H2V1>();
 			break;
 		}
 		case H2V2:
@@ -502,200 +1065,622 @@ namespace jpge {
 			m_comp_h_samp[1] = 1; m_comp_v_samp[1] = 1;
 			m_comp_h_samp[2] = 1; m_comp_v_samp[2] = 1;
 			m_mcu_x = 16; m_mcu_y = 16;
+			select_code_mcus<H2V2>();
 		}
 		}
 
 		m_image_x = p_x_res; m_image_y = p_y_res;
 		m_image_bpp = src_channels;
 		m_image_bpl = m_image_x * src_channels;
+		m_image_pitch = m_image_bpl;
 		m_image_x_mcu = (m_image_x + m_mcu_x - 1) & (~(m_mcu_x - 1));
 		m_image_y_mcu = (m_image_y + m_mcu_y - 1) & (~(m_mcu_y - 1));
-		m_image_bpl_xlt = m_image_x * m_num_components;
 		m_image_bpl_mcu = m_image_x_mcu * m_num_components;
 		m_mcus_per_row = m_image_x_mcu / m_mcu_x;
+		m_restart_interval = m_params.m_restart_per_mcu_row_flag ? m_mcus_per_row : m_params.m_restart_interval;
+		m_blocks_per_mcu = m_comp_h_samp[0] * m_comp_v_samp[0] + m_num_components - 1;
+		m_huff_sample_interval = ((m_params.m_cache_coefficients_flag) || (m_params.m_progressive_flag)) ? 1 : JPGE_MAX(m_params.m_huffman_sample_interval, 1);
+
+		m_has_sse2 = false;
+		m_has_avx2 = false;
+#if JPGE_USE_SSE2
+		m_has_sse2 = !m_params.m_no_simd_flag;
+#if JPGE_USE_AVX2
+		m_has_avx2 = m_has_sse2 && cpu_has_avx2();
+#endif
+#endif
+
+		pixel_format_t pixel_format = m_params.m_pixel_format;
+		if (pixel_format == PF_DEFAULT)
+			pixel_format = (m_image_bpp == 4) ? PF_RGBA : ((m_image_bpp == 3) ? PF_RGB : PF_Y);
+		const bool to_ycc = m_num_components > 1;
+		switch (pixel_format)
+		{
+		case PF_RGB: m_pColor_convert = get_color_convert_func<3, 0, 1, 2>(to_ycc, m_has_sse2, m_has_avx2); break;
+		case PF_BGR: m_pColor_convert = get_color_convert_func<3, 2, 1, 0>(to_ycc, m_has_sse2, m_has_avx2); break;
+		case PF_RGBA: m_pColor_convert = get_color_convert_func<4, 0, 1, 2>(to_ycc, m_has_sse2, m_has_avx2); break;
+		case PF_BGRA: m_pColor_convert = get_color_convert_func<4, 2, 1, 0>(to_ycc, m_has_sse2, m_has_avx2); break;
+		case PF_ARGB: m_pColor_convert = get_color_convert_func<4, 1, 2, 3>(to_ycc, m_has_sse2, m_has_avx2); break;
+		case PF_ABGR: m_pColor_convert = get_color_convert_func<4, 3, 2, 1>(to_ycc, m_has_sse2, m_has_avx2); break;
+		default:
+			m_pColor_convert = to_ycc ? Y_to_YCC : Y_to_Y;
+		}
 
-		if ((m_mcu_lines[0] = static_cast<uint8*>(jpge_malloc(m_image_bpl_mcu * m_mcu_y))) == NULL) return false;
+		// The buffers and tables are kept by deinit(), so they're only reallocated or recomputed when needed.
+		const size_t mcu_lines_size = static_cast<size_t>(m_image_bpl_mcu) * m_mcu_y;
+		if (mcu_lines_size > m_mcu_lines_size)
+		{
+			jpge_free(m_mcu_lines[0]);
+			m_mcu_lines_size = 0;
+			if ((m_mcu_lines[0] = static_cast<uint8*>(jpge_malloc(mcu_lines_size))) == NULL) return false;
+			m_mcu_lines_size = mcu_lines_size;
+		}
 		for (int i = 1; i < m_mcu_y; i++)
 			m_mcu_lines[i] = m_mcu_lines[i - 1] + m_image_bpl_mcu;
 
-		if (m_params.m_use_std_tables)
+		const int quant_key = m_params.m_quality | (m_params.m_use_std_tables << 8) | (m_params.m_no_chroma_discrim_flag << 9);
+		bool clear_block_cache = false;
+		if (quant_key != m_quant_key)
 		{
-			compute_quant_table(m_quantization_tables[0], s_std_lum_quant);
-			compute_quant_table(m_quantization_tables[1], m_params.m_no_chroma_discrim_flag ? s_std_lum_quant : s_std_croma_quant);
+			compute_quant_tables(m_quantization_tables, m_params);
+			compute_quant_reciprocals(0);
+			compute_quant_reciprocals(1);
+			m_quant_key = quant_key;
+			clear_block_cache = true;
 		}
-		else
+
+		uint block_cache_size = 0;
+		if (m_params.m_block_cache_size)
+			for (block_cache_size = 1; block_cache_size < static_cast<uint>(m_params.m_block_cache_size); block_cache_size <<= 1) { }
+		if (block_cache_size != m_block_cache_size)
 		{
-			compute_quant_table(m_quantization_tables[0], s_alt_quant);
-			memcpy(m_quantization_tables[1], m_quantization_tables[0], sizeof(m_quantization_tables[1]));
+			jpge_free(m_pBlock_cache);
+			m_pBlock_cache = NULL;
+			m_block_cache_size = 0;
+			if ((block_cache_size) && ((m_pBlock_cache = static_cast<block_cache_entry*>(jpge_malloc(block_cache_size * sizeof(block_cache_entry)))) == NULL)) return false;
+			m_block_cache_size = block_cache_size;
+			clear_block_cache = true;
 		}
+		if ((clear_block_cache) && (m_pBlock_cache))
+			memset(m_pBlock_cache, 0, m_block_cache_size * sizeof(block_cache_entry));
 
-		m_out_buf_left = JPGE_OUT_BUF_SIZE;
-		m_pOut_buf = m_out_buf;
+		const uint out_buf_size = static_cast<uint>(m_params.m_output_buffer_size);
+		if ((out_buf_size > JPGE_OUT_BUF_SIZE) && (out_buf_size != m_out_buf_alloc_size))
+		{
+			jpge_free(m_pOut_buf_alloc);
+			m_out_buf_alloc_size = 0;
+			if ((m_pOut_buf_alloc = static_cast<uint8*>(jpge_malloc(out_buf_size))) == NULL) return false;
+			m_out_buf_alloc_size = out_buf_size;
+		}
+		else if (out_buf_size <= JPGE_OUT_BUF_SIZE)
+		{
+			jpge_free(m_pOut_buf_alloc);
+			m_pOut_buf_alloc = NULL;
+			m_out_buf_alloc_size = 0;
+		}
+		m_pOut_buf_start = m_pOut_buf = NULL;
+		m_out_buf_left = 0;
+		m_out_buf_in_stream = false;
+
+		// The coefficients of the whole image when progressive, otherwise the ring of MCU rows of process_image_pipelined().
+		size_t coeffs_size = 0;
+		if (m_params.m_progressive_flag)
+			coeffs_size = static_cast<size_t>(m_mcus_per_row) * (m_image_y_mcu / m_mcu_y) * m_blocks_per_mcu * 64 * sizeof(int16);
+		else if (m_params.m_pipeline_flag)
+			coeffs_size = static_cast<size_t>(m_mcus_per_row) * JPGE_PIPELINE_ROWS * m_blocks_per_mcu * 64 * sizeof(int16);
+		if (coeffs_size > m_coeffs_size)
+		{
+			jpge_free(m_pCoeff_buf);
+			m_coeffs_size = 0;
+			if ((m_pCoeff_buf = static_cast<int16*>(jpge_malloc(coeffs_size))) == NULL) return false;
+			m_coeffs_size = coeffs_size;
+		}
 
-		if (m_params.m_two_pass_flag)
+		if (m_params.m_progressive_flag)
 		{
+			m_pCoeffs = m_pCoeff_buf;
+			first_pass_init();
+		}
+		else if (m_params.m_two_pass_flag)
+		{
+			if (m_params.m_cache_coefficients_flag)
+			{
+				if (!m_pCoeff_cache_buf)
+					m_pCoeff_cache_buf = new band_stream;
+				m_pCoeff_cache_buf->reset();
+				m_pCoeff_cache = m_pCoeff_cache_buf;
+			}
 			clear_obj(m_huff_count);
 			first_pass_init();
 		}
 		else
 		{
-			memcpy(m_huff_bits[0 + 0], s_dc_lum_bits, 17);    memcpy(m_huff_val[0 + 0], s_dc_lum_val, DC_LUM_CODES);
-			memcpy(m_huff_bits[2 + 0], s_ac_lum_bits, 17);    memcpy(m_huff_val[2 + 0], s_ac_lum_val, AC_LUM_CODES);
-			memcpy(m_huff_bits[0 + 1], s_dc_chroma_bits, 17); memcpy(m_huff_val[0 + 1], s_dc_chroma_val, DC_CHROMA_CODES);
-			memcpy(m_huff_bits[2 + 1], s_ac_chroma_bits, 17); memcpy(m_huff_val[2 + 1], s_ac_chroma_val, AC_CHROMA_CODES);
+			if (!m_std_huff_tables)
+			{
+				memcpy(m_huff_bits[0 + 0], s_dc_lum_bits, 17);    memcpy(m_huff_val[0 + 0], s_dc_lum_val, DC_LUM_CODES);
+				memcpy(m_huff_bits[2 + 0], s_ac_lum_bits, 17);    memcpy(m_huff_val[2 + 0], s_ac_lum_val, AC_LUM_CODES);
+				memcpy(m_huff_bits[0 + 1], s_dc_chroma_bits, 17); memcpy(m_huff_val[0 + 1], s_dc_chroma_val, DC_CHROMA_CODES);
+				memcpy(m_huff_bits[2 + 1], s_ac_chroma_bits, 17); memcpy(m_huff_val[2 + 1], s_ac_chroma_val, AC_CHROMA_CODES);
+				for (int i = 0; i < 4; i++)
+					compute_huffman_table(&m_huff_codes[i][0], &m_huff_code_sizes[i][0], m_huff_bits[i], m_huff_val[i]);
+				m_std_huff_tables = true;
+			}
 			if (!second_pass_init()) return false;   // in effect, skip over the first pass
 		}
 		return m_all_stream_writes_succeeded;
 	}
 
-	void jpeg_encoder::load_block_8_8_grey(int x)
+	// Loads the 8x8 block at x (in blocks), row y of the MCU, from the plane of component c.
+	void jpeg_encoder::load_block_8_8(int x, int y, int c)
 	{
 		uint8* pSrc;
 		sample_array_t* pDst = m_sample_array;
-		x <<= 3;
+		x = (x << 3) + c * m_image_x_mcu;
+		y <<= 3;
+#if JPGE_USE_SSE2
+		if (m_has_sse2)
+		{
+			const __m128i k_zero = _mm_setzero_si128(), k_128 = _mm_set1_epi16(128);
+			for (int i = 0; i < 8; i++, pDst += 8)
+			{
+				const __m128i s = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(m_mcu_lines[y + i] + x));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(pDst), _mm_sub_epi16(_mm_unpacklo_epi8(s, k_zero), k_128));
+			}
+			return;
+		}
+#endif
 		for (int i = 0; i < 8; i++, pDst += 8)
 		{
-			pSrc = m_mcu_lines[i] + x;
+			pSrc = m_mcu_lines[y + i] + x;
 			pDst[0] = pSrc[0] - 128; pDst[1] = pSrc[1] - 128; pDst[2] = pSrc[2] - 128; pDst[3] = pSrc[3] - 128;
 			pDst[4] = pSrc[4] - 128; pDst[5] = pSrc[5] - 128; pDst[6] = pSrc[6] - 128; pDst[7] = pSrc[7] - 128;
 		}
 	}
 
-	void jpeg_encoder::load_block_8_8(int x, int y, int c)
+#if JPGE_USE_SSE2
+	// Returns the sums of the 8 pairs of horizontally adjacent samples pSrc[0..15] in 16-bit lanes, for downsampling
+	// the chroma with exactly the rounding of the scalar code.
+	static inline __m128i get_pair_sums_sse2(const uint8* pSrc)
 	{
-		uint8* pSrc;
-		sample_array_t* pDst = m_sample_array;
-		x = (x * (8 * 3)) + c;
-		y <<= 3;
-		for (int i = 0; i < 8; i++, pDst += 8)
-		{
-			pSrc = m_mcu_lines[y + i] + x;
-			pDst[0] = pSrc[0 * 3] - 128; pDst[1] = pSrc[1 * 3] - 128; pDst[2] = pSrc[2 * 3] - 128; pDst[3] = pSrc[3 * 3] - 128;
-			pDst[4] = pSrc[4 * 3] - 128; pDst[5] = pSrc[5 * 3] - 128; pDst[6] = pSrc[6 * 3] - 128; pDst[7] = pSrc[7 * 3] - 128;
-		}
+		const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc));
+		return _mm_add_epi16(_mm_and_si128(s, _mm_set1_epi16(0xFF)), _mm_srli_epi16(s, 8));
 	}
+#endif
 
+	// Loads the 8x8 block of component c of MCU x, averaging 2x2 samples (H2V2).
 	void jpeg_encoder::load_block_16_8(int x, int c)
 	{
 		uint8* pSrc1, * pSrc2;
 		sample_array_t* pDst = m_sample_array;
-		x = (x * (16 * 3)) + c;
+		x = (x << 4) + c * m_image_x_mcu;
+#if JPGE_USE_SSE2
+		if (m_has_sse2)
+		{
+			const __m128i k_2 = _mm_set1_epi16(2), k_128 = _mm_set1_epi16(128);
+			for (int i = 0; i < 16; i += 2, pDst += 8)
+			{
+				const __m128i s = _mm_add_epi16(get_pair_sums_sse2(m_mcu_lines[i + 0] + x), get_pair_sums_sse2(m_mcu_lines[i + 1] + x));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(pDst), _mm_sub_epi16(_mm_srli_epi16(_mm_add_epi16(s, k_2), 2), k_128));
+			}
+			return;
+		}
+#endif
 		for (int i = 0; i < 16; i += 2, pDst += 8)
 		{
 			pSrc1 = m_mcu_lines[i + 0] + x;
 			pSrc2 = m_mcu_lines[i + 1] + x;
-			pDst[0] = ((pSrc1[0 * 3] + pSrc1[1 * 3] + pSrc2[0 * 3] + pSrc2[1 * 3] + 2) >> 2) - 128; pDst[1] = ((pSrc1[2 * 3] + pSrc1[3 * 3] + pSrc2[2 * 3] + pSrc2[3 * 3] + 2) >> 2) - 128;
-			pDst[2] = ((pSrc1[4 * 3] + pSrc1[5 * 3] + pSrc2[4 * 3] + pSrc2[5 * 3] + 2) >> 2) - 128; pDst[3] = ((pSrc1[6 * 3] + pSrc1[7 * 3] + pSrc2[6 * 3] + pSrc2[7 * 3] + 2) >> 2) - 128;
-			pDst[4] = ((pSrc1[8 * 3] + pSrc1[9 * 3] + pSrc2[8 * 3] + pSrc2[9 * 3] + 2) >> 2) - 128; pDst[5] = ((pSrc1[10 * 3] + pSrc1[11 * 3] + pSrc2[10 * 3] + pSrc2[11 * 3] + 2) >> 2) - 128;
-			pDst[6] = ((pSrc1[12 * 3] + pSrc1[13 * 3] + pSrc2[12 * 3] + pSrc2[13 * 3] + 2) >> 2) - 128; pDst[7] = ((pSrc1[14 * 3] + pSrc1[15 * 3] + pSrc2[14 * 3] + pSrc2[15 * 3] + 2) >> 2) - 128;
+			pDst[0] = ((pSrc1[0] + pSrc1[1] + pSrc2[0] + pSrc2[1] + 2) >> 2) - 128; pDst[1] = ((pSrc1[2] + pSrc1[3] + pSrc2[2] + pSrc2[3] + 2) >> 2) - 128;
+			pDst[2] = ((pSrc1[4] + pSrc1[5] + pSrc2[4] + pSrc2[5] + 2) >> 2) - 128; pDst[3] = ((pSrc1[6] + pSrc1[7] + pSrc2[6] + pSrc2[7] + 2) >> 2) - 128;
+			pDst[4] = ((pSrc1[8] + pSrc1[9] + pSrc2[8] + pSrc2[9] + 2) >> 2) - 128; pDst[5] = ((pSrc1[10] + pSrc1[11] + pSrc2[10] + pSrc2[11] + 2) >> 2) - 128;
+			pDst[6] = ((pSrc1[12] + pSrc1[13] + pSrc2[12] + pSrc2[13] + 2) >> 2) - 128; pDst[7] = ((pSrc1[14] + pSrc1[15] + pSrc2[14] + pSrc2[15] + 2) >> 2) - 128;
 		}
 	}
 
+	// Loads the 8x8 block of component c of MCU x, averaging 2x1 samples (H2V1).
 	void jpeg_encoder::load_block_16_8_8(int x, int c)
 	{
 		uint8* pSrc1;
 		sample_array_t* pDst = m_sample_array;
-		x = (x * (16 * 3)) + c;
+		x = (x << 4) + c * m_image_x_mcu;
+#if JPGE_USE_SSE2
+		if (m_has_sse2)
+		{
+			const __m128i k_1 = _mm_set1_epi16(1), k_128 = _mm_set1_epi16(128);
+			for (int i = 0; i < 8; i++, pDst += 8)
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(pDst), _mm_sub_epi16(_mm_srli_epi16(_mm_add_epi16(get_pair_sums_sse2(m_mcu_lines[i] + x), k_1), 1), k_128));
+			return;
+		}
+#endif
 		for (int i = 0; i < 8; i++, pDst += 8)
 		{
 			pSrc1 = m_mcu_lines[i + 0] + x;
-			pDst[0] = ((pSrc1[0 * 3] + pSrc1[1 * 3] + 1) >> 1) - 128; pDst[1] = ((pSrc1[2 * 3] + pSrc1[3 * 3] + 1) >> 1) - 128;
-			pDst[2] = ((pSrc1[4 * 3] + pSrc1[5 * 3] + 1) >> 1) - 128; pDst[3] = ((pSrc1[6 * 3] + pSrc1[7 * 3] + 1) >> 1) - 128;
-			pDst[4] = ((pSrc1[8 * 3] + pSrc1[9 * 3] + 1) >> 1) - 128; pDst[5] = ((pSrc1[10 * 3] + pSrc1[11 * 3] + 1) >> 1) - 128;
-			pDst[6] = ((pSrc1[12 * 3] + pSrc1[13 * 3] + 1) >> 1) - 128; pDst[7] = ((pSrc1[14 * 3] + pSrc1[15 * 3] + 1) >> 1) - 128;
+			pDst[0] = ((pSrc1[0] + pSrc1[1] + 1) >> 1) - 128; pDst[1] = ((pSrc1[2] + pSrc1[3] + 1) >> 1) - 128;
+			pDst[2] = ((pSrc1[4] + pSrc1[5] + 1) >> 1) - 128; pDst[3] = ((pSrc1[6] + pSrc1[7] + 1) >> 1) - 128;
+			pDst[4] = ((pSrc1[8] + pSrc1[9] + 1) >> 1) - 128; pDst[5] = ((pSrc1[10] + pSrc1[11] + 1) >> 1) - 128;
+			pDst[6] = ((pSrc1[12] + pSrc1[13] + 1) >> 1) - 128; pDst[7] = ((pSrc1[14] + pSrc1[15] + 1) >> 1) - 128;
 		}
 	}
 
+	// Reorders the DCT coefficients into zag order and quantizes them, rounding to nearest (see compute_quant_reciprocals()).
 	void jpeg_encoder::load_quantized_coefficients(int component_num)
 	{
-		int32* q = m_quantization_tables[component_num > 0];
-		int16* pDst = m_coefficient_array;
-		for (int i = 0; i < 64; i++)
+		const uint16* pRecip = m_quant_recip[component_num > 0], * pCorr = m_quant_corr[component_num > 0], * pScale = m_quant_scale[component_num > 0];
+		const sample_array_t* s = m_sample_array;
+#if JPGE_USE_SSE2
+		if (m_has_sse2)
 		{
-			sample_array_t j = m_sample_array[s_zag[i]];
-			if (j < 0)
-			{
-				if ((j = -j + (*q >> 1)) < *q)
-					*pDst++ = 0;
-				else
-					*pDst++ = static_cast<int16>(-(j / *q));
-			}
-			else
+			for (int i = 0; i < 64; i += 8)
 			{
-				if ((j = j + (*q >> 1)) < *q)
-					*pDst++ = 0;
-				else
-					*pDst++ = static_cast<int16>((j / *q));
+				const uint8* z = s_zag + i;
+				const __m128i x = _mm_setr_epi16(s[z[0]], s[z[1]], s[z[2]], s[z[3]], s[z[4]], s[z[5]], s[z[6]], s[z[7]]);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(m_coefficient_array + i), quantize_sse2(x, pRecip + i, pCorr + i, pScale + i));
 			}
-			q++;
+			return;
+		}
+#endif
+		for (int i = 0; i < 64; i++)
+		{
+			const int32 j = s[s_zag[i]];
+			uint t = ((static_cast<uint>(j < 0 ? -j : j) + pCorr[i]) * pRecip[i]) >> 16;
+			if (pScale[i])
+				t = (t * pScale[i]) >> 16;
+			m_coefficient_array[i] = static_cast<int16>(j < 0 ? -static_cast<int>(t) : static_cast<int>(t));
 		}
 	}
 
-	void jpeg_encoder::flush_output_buffer()
+	// Transforms and quantizes the block in m_sample_array into m_coefficient_array.
+	inline void jpeg_encoder::quantize_block(int component_num)
 	{
-		if (m_out_buf_left != JPGE_OUT_BUF_SIZE)
-			m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(m_out_buf, JPGE_OUT_BUF_SIZE - m_out_buf_left);
-		m_pOut_buf = m_out_buf;
-		m_out_buf_left = JPGE_OUT_BUF_SIZE;
+#if JPGE_USE_SSE2
+		if (m_has_sse2)
+			DCT2D_sse2(m_sample_array);
+		else
+#endif
+			DCT2D(m_sample_array);
+		load_quantized_coefficients(component_num);
 	}
 
-	void jpeg_encoder::put_bits(uint bits, uint len)
+	// Hashes the 64 samples of a block as 16 64-bit words, in two interleaved chains to shorten the dependency chain.
+	static inline uint64 hash_block(const int16* pSamples)
 	{
-		m_bit_buffer |= ((uint32)bits << (24 - (m_bits_in += len)));
-		while (m_bits_in >= 8)
+		uint64 a = 0, b = 0;
+		for (int i = 0; i < 64; i += 8)
 		{
-			uint8 c;
-#define JPGE_PUT_BYTE(c) { *m_pOut_buf++ = (c); if (--m_out_buf_left == 0) flush_output_buffer(); }
-			JPGE_PUT_BYTE(c = (uint8)((m_bit_buffer >> 16) & 0xFF));
-			if (c == 0xFF) JPGE_PUT_BYTE(0);
-			m_bit_buffer <<= 8;
-			m_bits_in -= 8;
+			uint64 x, y;
+			memcpy(&x, pSamples + i, sizeof(x));
+			memcpy(&y, pSamples + i + 4, sizeof(y));
+			a = (a ^ x) * 0x9E3779B97F4A7C15ULL;
+			b = (b ^ y) * 0xC2B2AE3D27D4EB4FULL;
 		}
+		uint64 h = a ^ ((b << 32) | (b >> 32));
+		h ^= h >> 29; h *= 0xBF58476D1CE4E5B9ULL; h ^= h >> 32;
+		return h;
 	}
 
-	void jpeg_encoder::code_coefficients_pass_one(int component_num)
+	// Like quantize_block(), but looks the samples up in the block cache first, and copies the cached coefficients if
+	// they're found. Otherwise the block replaces the entry it maps to once it's quantized.
+	void jpeg_encoder::quantize_cached_block(int component_num)
 	{
-		if (component_num >= 3) return; // just to shut up static analysis
-		int i, run_len, nbits, temp1;
-		int16* src = m_coefficient_array;
-		uint32* dc_count = component_num ? m_huff_count[0 + 1] : m_huff_count[0 + 0], * ac_count = component_num ? m_huff_count[2 + 1] : m_huff_count[2 + 0];
-
-		temp1 = src[0] - m_last_dc_val[component_num];
-		m_last_dc_val[component_num] = src[0];
-		if (temp1 < 0) temp1 = -temp1;
-
-		nbits = 0;
-		while (temp1)
+		const uint64 hash = (hash_block(m_sample_array) & ~1ULL) | static_cast<uint>(component_num > 0);
+		block_cache_entry& entry = m_pBlock_cache[(hash >> 32) & (m_block_cache_size - 1)];
+		if ((entry.m_hash == hash) && (memcmp(entry.m_samples, m_sample_array, sizeof(m_sample_array)) == 0))
 		{
-			nbits++; temp1 >>= 1;
+			memcpy(m_coefficient_array, entry.m_coeffs, sizeof(m_coefficient_array));
+			m_block_cache_hits++;
+			return;
 		}
+		m_block_cache_misses++;
+		entry.m_hash = hash;
+		memcpy(entry.m_samples, m_sample_array, sizeof(m_sample_array)); // before the DCT overwrites them
+		quantize_block(component_num);
+		memcpy(entry.m_coeffs, m_coefficient_array, sizeof(m_coefficient_array));
+	}
 
-		dc_count[nbits]++;
-		for (run_len = 0, i = 1; i < 64; i++)
+	// If the samples of the block span fewer than params::m_flat_block_threshold values, sets m_coefficient_array to just
+	// the block's quantized DC coefficient, computed from the sum of the samples exactly as DCT2D() would, and returns
+	// true. The AC coefficients of a uniform block are all 0, so it's coded exactly as it would have been.
+	bool jpeg_encoder::quantize_flat_block(int component_num)
+	{
+		const sample_array_t* s = m_sample_array;
+		int lo, hi, sum;
+#if JPGE_USE_SSE2
+		if (m_has_sse2)
 		{
-			if ((temp1 = m_coefficient_array[i]) == 0)
-				run_len++;
-			else
+			__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s)), vlo = x, vhi = x, vsum = x;
+			for (int i = 8; i < 64; i += 8)
 			{
-				while (run_len >= 16)
-				{
-					ac_count[0xF0]++;
-					run_len -= 16;
-				}
-				if (temp1 < 0) temp1 = -temp1;
-				nbits = 1;
-				while (temp1 >>= 1) nbits++;
-				ac_count[(run_len << 4) + nbits]++;
-				run_len = 0;
+				x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+				vlo = _mm_min_epi16(vlo, x); vhi = _mm_max_epi16(vhi, x); vsum = _mm_add_epi16(vsum, x); // each lane sums 8 samples, so no overflow
 			}
+			vlo = _mm_min_epi16(vlo, _mm_srli_si128(vlo, 8)); vlo = _mm_min_epi16(vlo, _mm_srli_si128(vlo, 4)); vlo = _mm_min_epi16(vlo, _mm_srli_si128(vlo, 2));
+			vhi = _mm_max_epi16(vhi, _mm_srli_si128(vhi, 8)); vhi = _mm_max_epi16(vhi, _mm_srli_si128(vhi, 4)); vhi = _mm_max_epi16(vhi, _mm_srli_si128(vhi, 2));
+			lo = static_cast<int16>(_mm_cvtsi128_si32(vlo));
+			hi = static_cast<int16>(_mm_cvtsi128_si32(vhi));
+			if (hi - lo >= m_params.m_flat_block_threshold)
+				return false;
+			vsum = _mm_madd_epi16(vsum, _mm_set1_epi16(1));
+			vsum = _mm_add_epi32(vsum, _mm_srli_si128(vsum, 8));
+			sum = _mm_cvtsi128_si32(_mm_add_epi32(vsum, _mm_srli_si128(vsum, 4)));
 		}
-		if (run_len) ac_count[0]++;
-	}
-
-	void jpeg_encoder::code_coefficients_pass_two(int component_num)
+		else
+#endif
+		{
+			lo = hi = sum = s[0];
+			for (int i = 1; i < 64; i++)
+			{
+				lo = JPGE_MIN(lo, static_cast<int>(s[i])); hi = JPGE_MAX(hi, static_cast<int>(s[i])); sum += s[i];
+			}
+			if (hi - lo >= m_params.m_flat_block_threshold)
+				return false;
+		}
+
+		const int dc = (sum + 4) >> 3;
+		const int table_num = component_num > 0;
+		uint t = ((static_cast<uint>(dc < 0 ? -dc : dc) + m_quant_corr[table_num][0]) * m_quant_recip[table_num][0]) >> 16;
+		if (m_quant_scale[table_num][0])
+			t = (t * m_quant_scale[table_num][0]) >> 16;
+		clear_obj(m_coefficient_array);
+		m_coefficient_array[0] = static_cast<int16>(dc < 0 ? -static_cast<int>(t) : static_cast<int>(t));
+		return true;
+	}
+
+	// Writes out the output buffer. Afterwards there's no output buffer until the next write, so the markers can be
+	// written to the stream directly.
+	void jpeg_encoder::flush_output_buffer()
+	{
+		const uint num_bytes = static_cast<uint>(m_pOut_buf - m_pOut_buf_start);
+		if (m_out_buf_in_stream)
+			m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->commit(num_bytes);
+		else if (num_bytes)
+			m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(m_pOut_buf_start, num_bytes);
+		m_pOut_buf_start = m_pOut_buf = NULL;
+		m_out_buf_left = 0;
+		m_out_buf_in_stream = false;
+	}
+
+	// Flushes the output buffer and starts a new one: writable memory of the stream itself if it has any, otherwise the
+	// internal buffer (m_out_buf, or m_pOut_buf_alloc if params::m_output_buffer_size is larger).
+	void jpeg_encoder::next_output_buffer()
+	{
+		flush_output_buffer();
+		uint size = 0;
+		uint8* pBuf = m_pStream->get_write_buffer(JPGE_MIN_WRITE_BUF_SIZE, size);
+		m_out_buf_in_stream = (pBuf != NULL) && (size);
+		if (!m_out_buf_in_stream)
+		{
+			pBuf = m_pOut_buf_alloc ? m_pOut_buf_alloc : m_out_buf;
+			size = m_pOut_buf_alloc ? m_out_buf_alloc_size : (m_params.m_output_buffer_size ? JPGE_MIN(m_params.m_output_buffer_size, (int)JPGE_OUT_BUF_SIZE) : JPGE_OUT_BUF_SIZE);
+		}
+		m_pOut_buf_start = m_pOut_buf = pBuf;
+		m_out_buf_left = size;
+	}
+
+#define JPGE_PUT_BYTE(c) { if (!m_out_buf_left) next_output_buffer(); *m_pOut_buf++ = (c); m_out_buf_left--; }
+
+	// The newest m_bits_in bits of m_bit_buffer are pending output. len must be <= 16, so the buffer is written out 6 bytes
+	// at a time before it can overflow. Call put_buffered_bytes(m_bits_in >> 3) to write out all the whole bytes.
+	void jpeg_encoder::put_bits(uint bits, uint len)
+	{
+		m_bit_buffer = (m_bit_buffer << len) | bits;
+		if ((m_bits_in += len) >= 48)
+			put_buffered_bytes(6);
+	}
+
+	// Writes out the oldest num_bytes (at most 7) whole bytes of the bit buffer. If none of them are 0xFF (or this is a
+	// band worker, which doesn't stuff), and they fit in the output buffer, they are copied without any per-byte checks.
+	void jpeg_encoder::put_buffered_bytes(uint num_bytes)
+	{
+		if (!num_bytes)
+			return;
+		m_bits_in -= num_bytes * 8;
+		const uint64 c = m_bit_buffer >> m_bits_in;
+		const uint shift = 64 - num_bytes * 8;
+		const uint64 x = (~c << shift) | ((((uint64)1) << shift) - 1); // 0xFF bytes become 0
+		if ((m_out_buf_left >= num_bytes) && ((m_pBand) || (((x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL) == 0)))
+		{
+			for (uint i = num_bytes; i; i--)
+				*m_pOut_buf++ = static_cast<uint8>(c >> ((i - 1) * 8));
+			m_out_buf_left -= num_bytes;
+			return;
+		}
+		for (uint i = num_bytes; i; i--)
+		{
+			const uint8 b = static_cast<uint8>(c >> ((i - 1) * 8));
+			JPGE_PUT_BYTE(b);
+			if ((b == 0xFF) && (!m_pBand)) JPGE_PUT_BYTE(0);
+		}
+	}
+
+	// Writes num_bytes bytes of unstuffed entropy coded data, stuffing a 0 after each 0xFF. The bit buffer must be empty.
+	// The runs of bytes up to each 0xFF are copied with memcpy().
+	void jpeg_encoder::put_stuffed_bytes(const uint8* pBuf, uint num_bytes)
+	{
+		while (num_bytes)
+		{
+			if (!m_out_buf_left)
+				next_output_buffer();
+			uint n = JPGE_MIN(num_bytes, m_out_buf_left);
+			const uint8* pFF = static_cast<const uint8*>(memchr(pBuf, 0xFF, n));
+			if (pFF)
+				n = static_cast<uint>(pFF - pBuf) + 1;
+			memcpy(m_pOut_buf, pBuf, n);
+			m_pOut_buf += n;
+			m_out_buf_left -= n;
+			pBuf += n;
+			num_bytes -= n;
+			if (pFF)
+				JPGE_PUT_BYTE(0);
+		}
+	}
+
+	// Writes a marker into the entropy coded data. The bit buffer must be empty.
+	void jpeg_encoder::put_marker_bytes(int marker)
+	{
+		JPGE_PUT_BYTE(0xFF);
+		JPGE_PUT_BYTE(static_cast<uint8>(marker));
+	}
+
+	// Pads the data to a byte boundary with 1 bits, then writes the next RSTn marker. Both passes reset the DC predictors.
+	void jpeg_encoder::emit_restart()
+	{
+		if (m_pass_num == 2)
+		{
+			if (m_pBand)
+				end_band_segment();
+			else
+			{
+				put_bits(0x7F, 7);
+				put_buffered_bytes(m_bits_in >> 3);
+				m_bit_buffer = 0; m_bits_in = 0;
+				put_marker_bytes(M_RST0 + (m_restart_num & 7));
+			}
+			m_restart_num++;
+		}
+		memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
+	}
+
+	// Called before coding each MCU when restart intervals are enabled.
+	void jpeg_encoder::check_restart()
+	{
+		if (!m_restart_mcus_left)
+		{
+			emit_restart();
+			m_restart_mcus_left = m_restart_interval;
+		}
+		m_restart_mcus_left--;
+	}
+
+	// Sets up the restart interval counters for coding to resume at MCU mcu_index (counted from the start of the image).
+	void jpeg_encoder::set_restart_state(int mcu_index)
+	{
+		m_restart_mcus_left = m_restart_interval;
+		m_restart_num = 0;
+		if ((m_restart_interval) && (mcu_index))
+		{
+			const uint intervals = mcu_index / m_restart_interval, rem = mcu_index % m_restart_interval;
+			m_restart_mcus_left = rem ? (m_restart_interval - rem) : 0;
+			m_restart_num = rem ? intervals : (intervals - 1);
+		}
+	}
+
+	// Returns a mask with bit i set if pSrc[i] is nonzero.
+	static inline uint64 get_nonzero_mask(const int16* pSrc, bool use_simd)
+	{
+		uint64 mask = 0;
+#if JPGE_USE_SSE2
+		if (use_simd)
+		{
+			const __m128i zero = _mm_setzero_si128();
+			for (int i = 0; i < 64; i += 16)
+			{
+				const __m128i a = _mm_cmpeq_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc + i)), zero);
+				const __m128i b = _mm_cmpeq_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc + i + 8)), zero);
+				mask |= static_cast<uint64>(~_mm_movemask_epi8(_mm_packs_epi16(a, b)) & 0xFFFF) << i;
+			}
+			return mask;
+		}
+#else
+		(void)use_simd;
+#endif
+		for (int i = 0; i < 64; i++)
+			mask |= static_cast<uint64>(pSrc[i] != 0) << i;
+		return mask;
+	}
+
+	// Returns the index of the lowest set bit of v, which must be nonzero.
+	static inline uint get_lowest_set_bit(uint64 v)
 	{
-		int i, j, run_len, nbits, temp1, temp2;
-		int16* pSrc = m_coefficient_array;
+#if defined(_MSC_VER)
+		unsigned long i;
+#if defined(_M_X64)
+		_BitScanForward64(&i, v);
+#else
+		if (!_BitScanForward(&i, static_cast<unsigned long>(v)))
+		{
+			_BitScanForward(&i, static_cast<unsigned long>(v >> 32));
+			i += 32;
+		}
+#endif
+		return i;
+#elif defined(__GNUC__)
+		return __builtin_ctzll(v);
+#else
+		uint i = 0;
+		while (!(v & 1)) { v >>= 1; i++; }
+		return i;
+#endif
+	}
+
+	// Returns the index of the highest set bit of v, which must be nonzero.
+	static inline uint get_highest_set_bit(uint64 v)
+	{
+#if defined(_MSC_VER)
+		unsigned long i;
+#if defined(_M_X64)
+		_BitScanReverse64(&i, v);
+#else
+		if (_BitScanReverse(&i, static_cast<unsigned long>(v >> 32)))
+			i += 32;
+		else
+			_BitScanReverse(&i, static_cast<unsigned long>(v));
+#endif
+		return i;
+#elif defined(__GNUC__)
+		return 63 - __builtin_clzll(v);
+#else
+		uint i = 0;
+		while (v >>= 1) i++;
+		return i;
+#endif
+	}
+
+	// Returns the number of bits needed to hold v (the JPEG magnitude category), 0 for 0.
+	static inline uint get_num_bits(uint v)
+	{
+		if (!v)
+			return 0;
+#if defined(_MSC_VER)
+		unsigned long i;
+		_BitScanReverse(&i, v);
+		return i + 1;
+#elif defined(__GNUC__)
+		return 32 - __builtin_clz(v);
+#else
+		uint n = 0;
+		while (v) { n++; v >>= 1; }
+		return n;
+#endif
+	}
+
+	// Both coding passes step through the nonzero coefficients with mask (see get_nonzero_mask()), so the zero runs
+	// between them are skipped over.
+	void jpeg_encoder::code_coefficients_pass_one(int component_num, const int16* src, uint64 mask)
+	{
+		if (component_num >= 3) return; // just to shut up static analysis
+		int run_len, temp1;
+		uint32* dc_count = component_num ? m_huff_count[0 + 1] : m_huff_count[0 + 0], * ac_count = component_num ? m_huff_count[2 + 1] : m_huff_count[2 + 0];
+
+		temp1 = src[0] - m_last_dc_val[component_num];
+		m_last_dc_val[component_num] = src[0];
+		if (temp1 < 0) temp1 = -temp1;
+		dc_count[get_num_bits(temp1)]++;
+
+		uint last = 0;
+		for (mask &= ~static_cast<uint64>(1); mask; mask &= mask - 1)
+		{
+			const uint i = get_lowest_set_bit(mask);
+			run_len = i - last - 1;
+			last = i;
+			ac_count[0xF0] += run_len >> 4;
+			if ((temp1 = src[i]) < 0) temp1 = -temp1;
+			ac_count[((run_len & 15) << 4) + get_num_bits(temp1)]++;
+		}
+		if (last != 63) ac_count[0]++;
+	}
+
+	void jpeg_encoder::code_coefficients_pass_two(int component_num, const int16* pSrc, uint64 mask)
+	{
+		int run_len, nbits, temp1, temp2;
 		uint* codes[2];
 		uint8* code_sizes[2];
 
@@ -718,111 +1703,563 @@ namespace jpge {
 			temp1 = -temp1; temp2--;
 		}
 
-		nbits = 0;
-		while (temp1)
+		nbits = get_num_bits(temp1);
+		put_bits(codes[0][nbits], code_sizes[0][nbits]);
+		if (nbits) put_bits(temp2 & ((1 << nbits) - 1), nbits);
+
+		uint last = 0;
+		for (mask &= ~static_cast<uint64>(1); mask; mask &= mask - 1)
 		{
-			nbits++; temp1 >>= 1;
+			const uint i = get_lowest_set_bit(mask);
+			run_len = i - last - 1;
+			last = i;
+			while (run_len >= 16)
+			{
+				put_bits(codes[1][0xF0], code_sizes[1][0xF0]);
+				run_len -= 16;
+			}
+			if ((temp2 = temp1 = pSrc[i]) < 0)
+			{
+				temp1 = -temp1;
+				temp2--;
+			}
+			nbits = get_num_bits(temp1);
+			const int j = (run_len << 4) + nbits;
+			put_bits(codes[1][j], code_sizes[1][j]);
+			put_bits(temp2 & ((1 << nbits) - 1), nbits);
 		}
+		if (last != 63)
+			put_bits(codes[1][0], code_sizes[1][0]);
+	}
 
-		put_bits(codes[0][nbits], code_sizes[0][nbits]);
-		if (nbits) put_bits(temp2 & ((1 << nbits) - 1), nbits);
+	// Codes the quantized coefficients of a block in pass one or two (MODE is BLOCK_PASS_ONE or BLOCK_PASS_TWO).
+	template<int MODE> inline void jpeg_encoder::code_coefficients(int component_num, const int16* pSrc)
+	{
+		const uint64 mask = get_nonzero_mask(pSrc, m_has_sse2);
+		if (MODE == BLOCK_PASS_ONE)
+		{
+			code_coefficients_pass_one(component_num, pSrc, mask);
+			if (m_pCoeff_cache)
+				cache_coefficients(pSrc, mask);
+		}
+		else
+			code_coefficients_pass_two(component_num, pSrc, mask);
+	}
+
+	// Transforms and quantizes the block in m_sample_array, and codes it as MODE says.
+	template<int MODE> inline void jpeg_encoder::code_block(int component_num)
+	{
+		if ((!m_params.m_flat_block_threshold) || (!quantize_flat_block(component_num)))
+		{
+			if (m_pBlock_cache)
+				quantize_cached_block(component_num);
+			else
+				quantize_block(component_num);
+		}
+		if (MODE == BLOCK_STORE)
+		{
+			memcpy(m_pCoeff_dst, m_coefficient_array, sizeof(m_coefficient_array)); // coded by code_progressive_scans() or process_image_pipelined()
+			m_pCoeff_dst += 64;
+		}
+		else if (MODE == BLOCK_DC_ONLY)
+			m_last_dc_val[component_num] = m_coefficient_array[0];
+		else
+			code_coefficients<MODE>(component_num, m_coefficient_array);
+	}
+
+	void jpeg_encoder::code_block(int component_num)
+	{
+		switch (get_block_mode())
+		{
+		case BLOCK_DC_ONLY: code_block<BLOCK_DC_ONLY>(component_num); break;
+		case BLOCK_PASS_ONE: code_block<BLOCK_PASS_ONE>(component_num); break;
+		case BLOCK_PASS_TWO: code_block<BLOCK_PASS_TWO>(component_num); break;
+		case BLOCK_STORE: code_block<BLOCK_STORE>(component_num); break;
+		}
+	}
+
+	// Returns the number of coefficients of a cached block: all of them up to the last nonzero one, and at least the DC.
+	static inline uint get_num_cached_coefficients(uint64 mask)
+	{
+		return mask ? (get_highest_set_bit(mask) + 1) : 1;
+	}
+
+	// Appends the block's quantized coefficients to the coefficient cache: its nonzero mask, followed by the coefficients
+	// it has room for (see get_num_cached_coefficients()). Blocks are an even number of bytes, so the coefficients stay aligned.
+	void jpeg_encoder::cache_coefficients(const int16* pSrc, uint64 mask)
+	{
+		const uint num_coeffs = get_num_cached_coefficients(mask);
+		uint8* pDst = m_pCoeff_cache->append(sizeof(mask) + num_coeffs * sizeof(int16));
+		if (!pDst)
+		{
+			m_all_stream_writes_succeeded = false;
+			return;
+		}
+		memcpy(pDst, &mask, sizeof(mask));
+		memcpy(pDst + sizeof(mask), pSrc, num_coeffs * sizeof(int16));
+	}
+
+	// Runs the second pass on the coefficients cached by the first pass.
+	void jpeg_encoder::code_cached_coefficients()
+	{
+		uint8 block_comps[6];
+		int num_blocks = 0;
+		for (int c = 0; c < m_num_components; c++)
+			for (int i = 0; i < m_comp_h_samp[c] * m_comp_v_samp[c]; i++)
+				block_comps[num_blocks++] = static_cast<uint8>(c);
+
+		const uint8* pSrc = m_pCoeff_cache->get_buf();
+		const int num_mcus = m_mcus_per_row * (m_image_y_mcu / m_mcu_y);
+		for (int i = 0; i < num_mcus; i++)
+		{
+			if (m_restart_interval) check_restart();
+			for (int j = 0; j < num_blocks; j++)
+			{
+				uint64 mask;
+				memcpy(&mask, pSrc, sizeof(mask));
+				pSrc += sizeof(mask);
+				code_coefficients_pass_two(block_comps[j], reinterpret_cast<const int16*>(pSrc), mask);
+				pSrc += get_num_cached_coefficients(mask) * sizeof(int16);
+			}
+		}
+	}
+
+	// Progressive scans are coded twice, like the two passes of a baseline image: pass 1 counts the Huffman symbols
+	// (and writes nothing), pass 2 writes them.
+	void jpeg_encoder::put_symbol(int table_num, uint sym)
+	{
+		if (m_pass_num == 1)
+			m_huff_count[table_num][sym]++;
+		else
+			put_bits(m_huff_codes[table_num][sym], m_huff_code_sizes[table_num][sym]);
+	}
+
+	void jpeg_encoder::put_scan_bits(uint bits, uint len)
+	{
+		if (m_pass_num == 2)
+			put_bits(bits, len);
+	}
+
+	void jpeg_encoder::put_correction_bits(const uint8* pBits, uint num_bits)
+	{
+		if (m_pass_num == 2)
+		{
+			for (uint i = 0; i < num_bits; i++)
+				put_bits(pBits[i], 1);
+		}
+	}
+
+	// Codes the pending run of blocks that end with an EOB in the current AC scan, followed by the correction bits
+	// of any refined coefficients in those blocks.
+	void jpeg_encoder::put_eob_run(int table_num)
+	{
+		if (!m_eob_run)
+			return;
+		const uint nbits = get_num_bits(m_eob_run) - 1;
+		put_symbol(table_num, nbits << 4);
+		if (nbits)
+			put_scan_bits(m_eob_run & ((1 << nbits) - 1), nbits);
+		m_eob_run = 0;
+		put_correction_bits(m_corr_bits, m_num_corr_bits);
+		m_num_corr_bits = 0;
+	}
+
+	// Codes the part of a block that belongs to a progressive scan. See ITU T.81 G.1.2.
+	void jpeg_encoder::code_progressive_block(const int16* pBlock, int component_num, const scan_info& scan)
+	{
+		const int t = component_num > 0;
+		if (!scan.m_Se)
+		{
+			if (scan.m_Ah)
+			{
+				put_scan_bits((pBlock[0] >> scan.m_Al) & 1, 1);
+				return;
+			}
+			const int dc = pBlock[0] >> scan.m_Al;
+			int temp1 = dc - m_last_dc_val[component_num], temp2 = temp1;
+			m_last_dc_val[component_num] = dc;
+			if (temp1 < 0)
+			{
+				temp1 = -temp1; temp2--;
+			}
+			const uint nbits = get_num_bits(temp1);
+			put_symbol(0 + t, nbits);
+			if (nbits) put_scan_bits(temp2 & ((1 << nbits) - 1), nbits);
+			return;
+		}
 
-		for (run_len = 0, i = 1; i < 64; i++)
+		// The coefficients of the scan's band that are nonzero before the point transform.
+		const uint64 mask = get_nonzero_mask(pBlock, m_has_sse2) & (~static_cast<uint64>(0) >> (63 - scan.m_Se)) & ~((static_cast<uint64>(1) << scan.m_Ss) - 1);
+		if (scan.m_Ah)
 		{
-			if ((temp1 = m_coefficient_array[i]) == 0)
-				run_len++;
+			code_ac_refine(pBlock, 2 + t, scan, mask);
+			return;
+		}
+
+		int last = scan.m_Ss - 1; // the last coefficient coded
+		for (uint64 m = mask; m; m &= m - 1)
+		{
+			const int k = get_lowest_set_bit(m);
+			int temp1 = pBlock[k], temp2;
+			if (temp1 < 0)
+			{
+				temp1 = -temp1 >> scan.m_Al; temp2 = ~temp1;
+			}
 			else
 			{
-				while (run_len >= 16)
+				temp1 >>= scan.m_Al; temp2 = temp1;
+			}
+			if (!temp1)
+				continue;
+			int run_len = k - last - 1;
+			last = k;
+			put_eob_run(2 + t);
+			for (; run_len >= 16; run_len -= 16)
+				put_symbol(2 + t, 0xF0);
+			const uint nbits = get_num_bits(temp1);
+			put_symbol(2 + t, (run_len << 4) + nbits);
+			put_scan_bits(temp2 & ((1 << nbits) - 1), nbits);
+		}
+		if ((last != scan.m_Se) && (++m_eob_run == 0x7FFF))
+			put_eob_run(2 + t);
+	}
+
+	// Codes an AC successive approximation refinement scan of a block. Coefficients that become nonzero are coded like
+	// in a first scan (with a magnitude of 1), the next bit of coefficients that were already nonzero is sent as a
+	// correction bit after the next symbol. Zero runs that end the block become part of an EOB run, so their correction
+	// bits are kept in m_corr_bits until the run is coded.
+	void jpeg_encoder::code_ac_refine(const int16* pBlock, int table_num, const scan_info& scan, uint64 mask)
+	{
+		int eob = 0; // the last newly nonzero coefficient
+		for (uint64 m = mask; m; m &= m - 1)
+		{
+			const int k = get_lowest_set_bit(m);
+			if (((pBlock[k] < 0 ? -pBlock[k] : pBlock[k]) >> scan.m_Al) == 1)
+				eob = k;
+		}
+
+		int run_len = 0, last = scan.m_Ss - 1;
+		uint num_bits = 0;
+		uint8* pBits = m_corr_bits + m_num_corr_bits;
+		for (uint64 m = mask; m; m &= m - 1)
+		{
+			const int k = get_lowest_set_bit(m);
+			const int abs_value = (pBlock[k] < 0 ? -pBlock[k] : pBlock[k]) >> scan.m_Al;
+			if (!abs_value)
+				continue;
+			run_len += k - last - 1;
+			last = k;
+			while ((run_len >= 16) && (k <= eob))
+			{
+				put_eob_run(table_num);
+				put_symbol(table_num, 0xF0);
+				run_len -= 16;
+				put_correction_bits(pBits, num_bits);
+				pBits = m_corr_bits; num_bits = 0;
+			}
+			if (abs_value > 1)
+			{
+				pBits[num_bits++] = static_cast<uint8>(abs_value & 1);
+				continue;
+			}
+			put_eob_run(table_num);
+			put_symbol(table_num, (run_len << 4) + 1);
+			put_scan_bits(pBlock[k] < 0 ? 0 : 1, 1);
+			put_correction_bits(pBits, num_bits);
+			pBits = m_corr_bits; num_bits = 0;
+			run_len = 0;
+		}
+		run_len += scan.m_Se - last;
+		if ((run_len) || (num_bits))
+		{
+			m_eob_run++;
+			m_num_corr_bits += num_bits;
+			if ((m_eob_run == 0x7FFF) || (m_num_corr_bits > JPGE_MAX_CORR_BITS - 64))
+				put_eob_run(table_num);
+		}
+	}
+
+	// Runs the current pass of a progressive scan over the buffered coefficients. Scans with several components go
+	// through the image in MCU order, single component scans go through the component's blocks in raster order.
+	void jpeg_encoder::code_scan(const scan_info& scan)
+	{
+		m_bit_buffer = 0; m_bits_in = 0;
+		memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
+		m_eob_run = 0;
+		m_num_corr_bits = 0;
+		set_restart_state(0);
+
+		if (scan.m_num_comps > 1)
+		{
+			uint8 block_comps[6];
+			int num_blocks = 0;
+			for (int c = 0; c < m_num_components; c++)
+				for (int i = 0; i < m_comp_h_samp[c] * m_comp_v_samp[c]; i++)
+					block_comps[num_blocks++] = static_cast<uint8>(c);
+
+			const int16* pBlock = m_pCoeffs;
+			const int num_mcus = m_mcus_per_row * (m_image_y_mcu / m_mcu_y);
+			for (int i = 0; i < num_mcus; i++)
+			{
+				if (m_restart_interval) check_restart();
+				for (int j = 0; j < num_blocks; j++, pBlock += 64)
 				{
-					put_bits(codes[1][0xF0], code_sizes[1][0xF0]);
-					run_len -= 16;
+					for (int k = 0; k < scan.m_num_comps; k++)
+						if (scan.m_comp_index[k] == block_comps[j])
+							code_progressive_block(pBlock, block_comps[j], scan);
 				}
-				if ((temp2 = temp1) < 0)
+			}
+			return;
+		}
+
+		const int c = scan.m_comp_index[0], t = 2 + (c > 0);
+		const int h = m_comp_h_samp[c], v = m_comp_v_samp[c];
+		const int blocks_x = (((m_image_x * h + m_comp_h_samp[0] - 1) / m_comp_h_samp[0]) + 7) >> 3;
+		const int blocks_y = (((m_image_y * v + m_comp_v_samp[0] - 1) / m_comp_v_samp[0]) + 7) >> 3;
+		const int first_block = c ? (m_comp_h_samp[0] * m_comp_v_samp[0] + c - 1) : 0;
+		for (int by = 0; by < blocks_y; by++)
+		{
+			for (int bx = 0; bx < blocks_x; bx++)
+			{
+				if (m_restart_interval)
 				{
-					temp1 = -temp1;
-					temp2--;
+					if (!m_restart_mcus_left)
+						put_eob_run(t);
+					check_restart();
 				}
-				nbits = 1;
-				while (temp1 >>= 1)
-					nbits++;
-				j = (run_len << 4) + nbits;
-				put_bits(codes[1][j], code_sizes[1][j]);
-				put_bits(temp2 & ((1 << nbits) - 1), nbits);
-				run_len = 0;
+				const size_t block_index = static_cast<size_t>((by / v) * m_mcus_per_row + (bx / h)) * m_blocks_per_mcu + first_block + (by % v) * h + (bx % h);
+				code_progressive_block(m_pCoeffs + block_index * 64, c, scan);
 			}
 		}
-		if (run_len)
-			put_bits(codes[1][0], code_sizes[1][0]);
+		put_eob_run(t);
 	}
 
-	void jpeg_encoder::code_block(int component_num)
+	// Writes a progressive image from the coefficients buffered by the first pass. Each scan is coded once to gather
+	// its statistics, and again to write it with the Huffman tables optimized for it.
+	bool jpeg_encoder::code_progressive_scans()
 	{
-		DCT2D(m_sample_array);
-		load_quantized_coefficients(component_num);
-		if (m_pass_num == 1)
-			code_coefficients_pass_one(component_num);
-		else
-			code_coefficients_pass_two(component_num);
+		const scan_info* pScans = m_params.m_pScan_script;
+		int num_scans = m_params.m_num_scans;
+		if (!pScans)
+		{
+			pScans = (m_num_components == 1) ? s_progressive_y_scans : s_progressive_ycc_scans;
+			num_scans = (m_num_components == 1) ? (sizeof(s_progressive_y_scans) / sizeof(scan_info)) : (sizeof(s_progressive_ycc_scans) / sizeof(scan_info));
+		}
+
+		emit_markers();
+		for (int i = 0; (i < num_scans) && (m_all_stream_writes_succeeded); i++)
+		{
+			const scan_info& scan = pScans[i];
+			if (i)
+			{
+				put_bits(0x7F, 7);
+				put_buffered_bytes(m_bits_in >> 3);
+				flush_output_buffer();
+			}
+
+			if ((scan.m_Se) || (!scan.m_Ah)) // DC refinement scans are just bits, without Huffman codes
+			{
+				clear_obj(m_huff_count);
+				m_pass_num = 1;
+				code_scan(scan);
+
+				bool table_emitted[2] = { false, false };
+				for (int j = 0; j < scan.m_num_comps; j++)
+				{
+					const int t = scan.m_comp_index[j] > 0, table_num = (scan.m_Se ? 2 : 0) + t;
+					if (table_emitted[t])
+						continue;
+					table_emitted[t] = true;
+					optimize_huffman_table(table_num, scan.m_Se ? AC_LUM_CODES : DC_LUM_CODES);
+					compute_huffman_table(&m_huff_codes[table_num][0], &m_huff_code_sizes[table_num][0], m_huff_bits[table_num], m_huff_val[table_num]);
+					emit_dht(m_huff_bits[table_num], m_huff_val[table_num], t, scan.m_Se != 0);
+				}
+			}
+
+			emit_sos(scan);
+			flush_header();
+			m_pass_num = 2;
+			code_scan(scan);
+		}
+		if (!m_all_stream_writes_succeeded) return false;
+		return terminate_pass_two();
 	}
 
 	void jpeg_encoder::process_mcu_row()
 	{
-		if (m_num_components == 1)
+		process_mcus(0, m_mcus_per_row);
+	}
+
+	// Codes an MCU row of quantized blocks stored by code_block() (see m_pCoeff_dst), as process_mcu_row() would have
+	// in pass MODE.
+	template<int MODE> void jpeg_encoder::code_mcu_row_coefficients(const int16* pSrc)
+	{
+		const int num_y_blocks = m_comp_h_samp[0] * m_comp_v_samp[0];
+		for (int i = 0; i < m_mcus_per_row; i++)
 		{
-			for (int i = 0; i < m_mcus_per_row; i++)
-			{
-				load_block_8_8_grey(i); code_block(0);
-			}
+			if (m_restart_interval) check_restart();
+			for (int j = 0; j < m_blocks_per_mcu; j++, pSrc += 64)
+				code_coefficients<MODE>((j < num_y_blocks) ? 0 : (j - num_y_blocks + 1), pSrc);
 		}
-		else if ((m_comp_h_samp[0] == 1) && (m_comp_v_samp[0] == 1))
+	}
+
+	// Loads the 8x8 block at (x, y) of a plane of width by height samples, step bytes apart, replicating the last column
+	// and row past the edges of the plane.
+	void jpeg_encoder::load_plane_block(const uint8* pPlane, int pitch, int step, int width, int height, int x, int y)
+	{
+		sample_array_t* pDst = m_sample_array;
+		for (int i = 0; i < 8; i++, pDst += 8)
 		{
-			for (int i = 0; i < m_mcus_per_row; i++)
+			const uint8* pSrc = pPlane + static_cast<ptrdiff_t>(JPGE_MIN(y + i, height - 1)) * pitch;
+			if ((step == 1) && (x + 8 <= width))
 			{
-				load_block_8_8(i, 0, 0); code_block(0); load_block_8_8(i, 0, 1); code_block(1); load_block_8_8(i, 0, 2); code_block(2);
+				pSrc += x;
+				pDst[0] = pSrc[0] - 128; pDst[1] = pSrc[1] - 128; pDst[2] = pSrc[2] - 128; pDst[3] = pSrc[3] - 128;
+				pDst[4] = pSrc[4] - 128; pDst[5] = pSrc[5] - 128; pDst[6] = pSrc[6] - 128; pDst[7] = pSrc[7] - 128;
+			}
+			else
+			{
+				for (int j = 0; j < 8; j++)
+					pDst[j] = pSrc[JPGE_MIN(x + j, width - 1) * step] - 128;
 			}
 		}
-		else if ((m_comp_h_samp[0] == 2) && (m_comp_v_samp[0] == 1))
+	}
+
+	// Codes MCU's [first_mcu, end_mcu) of MCU row m_yuv_mcu_row, with the blocks read straight from the YCbCr planes.
+	void jpeg_encoder::process_yuv_mcus(int first_mcu, int end_mcu)
+	{
+		const yuv_image& image = *m_pYUV;
+		const int step = (image.m_format == YUV_NV12) ? 2 : 1;
+		const int chroma_x = (m_image_x + (1 << m_yuv_h_shift) - 1) >> m_yuv_h_shift, chroma_y = (m_image_y + (1 << m_yuv_v_shift) - 1) >> m_yuv_v_shift;
+		const uint8* pCr = (step == 2) ? (image.m_pCb + 1) : image.m_pCr;
+		const int cr_pitch = (step == 2) ? image.m_cb_pitch : image.m_cr_pitch;
+		for (int i = first_mcu; i < end_mcu; i++)
 		{
-			for (int i = 0; i < m_mcus_per_row; i++)
+			if (m_restart_interval) check_restart();
+			for (int y = 0; y < m_comp_v_samp[0]; y++)
 			{
-				load_block_8_8(i * 2 + 0, 0, 0); code_block(0); load_block_8_8(i * 2 + 1, 0, 0); code_block(0);
-				load_block_16_8_8(i, 1); code_block(1); load_block_16_8_8(i, 2); code_block(2);
+				for (int x = 0; x < m_comp_h_samp[0]; x++)
+				{
+					load_plane_block(image.m_pY, image.m_y_pitch, 1, m_image_x, m_image_y, i * m_mcu_x + x * 8, m_yuv_mcu_row * m_mcu_y + y * 8);
+					code_block(0);
+				}
+			}
+			if (m_num_components == 3)
+			{
+				load_plane_block(image.m_pCb, image.m_cb_pitch, step, chroma_x, chroma_y, i * 8, m_yuv_mcu_row * 8); code_block(1);
+				load_plane_block(pCr, cr_pitch, step, chroma_x, chroma_y, i * 8, m_yuv_mcu_row * 8); code_block(2);
 			}
 		}
-		else if ((m_comp_h_samp[0] == 2) && (m_comp_v_samp[0] == 2))
+	}
+
+	// Codes MCU's [first_mcu, end_mcu) of the currently loaded MCU row, with the MCU layout and what's done with the
+	// blocks known at compile time.
+	template<int SUBSAMPLING, int MODE> void jpeg_encoder::code_mcus(int first_mcu, int end_mcu)
+	{
+		for (int i = first_mcu; i < end_mcu; i++)
 		{
-			for (int i = 0; i < m_mcus_per_row; i++)
+			if (m_restart_interval) check_restart();
+			if (SUBSAMPLING == Y_ONLY)
 			{
-				load_block_8_8(i * 2 + 0, 0, 0); code_block(0); load_block_8_8(i * 2 + 1, 0, 0); code_block(0);
-				load_block_8_8(i * 2 + 0, 1, 0); code_block(0); load_block_8_8(i * 2 + 1, 1, 0); code_block(0);
-				load_block_16_8(i, 1); code_block(1); load_block_16_8(i, 2); code_block(2);
+				load_block_8_8(i, 0, 0); code_block<MODE>(0);
 			}
+			else if (SUBSAMPLING == H1V1)
+			{
+				load_block_8_8(i, 0, 0); code_block<MODE>(0); load_block_8_8(i, 0, 1); code_block<MODE>(1); load_block_8_8(i, 0, 2); code_block<MODE>(2);
+			}
+			else if (SUBSAMPLING == H2V1)
+			{
+				load_block_8_8(i * 2 + 0, 0, 0); code_block<MODE>(0); load_block_8_8(i * 2 + 1, 0, 0); code_block<MODE>(0);
+				load_block_16_8_8(i, 1); code_block<MODE>(1); load_block_16_8_8(i, 2); code_block<MODE>(2);
+			}
+			else
+			{
+				load_block_8_8(i * 2 + 0, 0, 0); code_block<MODE>(0); load_block_8_8(i * 2 + 1, 0, 0); code_block<MODE>(0);
+				load_block_8_8(i * 2 + 0, 1, 0); code_block<MODE>(0); load_block_8_8(i * 2 + 1, 1, 0); code_block<MODE>(0);
+				load_block_16_8(i, 1); code_block<MODE>(1); load_block_16_8(i, 2); code_block<MODE>(2);
+			}
+		}
+	}
+
+	// Picks the code_mcus() specializations for the image's subsampling, one per block mode.
+	template<int SUBSAMPLING> void jpeg_encoder::select_code_mcus()
+	{
+		m_pCode_mcus[BLOCK_DC_ONLY] = &jpeg_encoder::code_mcus<SUBSAMPLING, BLOCK_DC_ONLY>;
+		m_pCode_mcus[BLOCK_PASS_ONE] = &jpeg_encoder::code_mcus<SUBSAMPLING, BLOCK_PASS_ONE>;
+		m_pCode_mcus[BLOCK_PASS_TWO] = &jpeg_encoder::code_mcus<SUBSAMPLING, BLOCK_PASS_TWO>;
+		m_pCode_mcus[BLOCK_STORE] = &jpeg_encoder::code_mcus<SUBSAMPLING, BLOCK_STORE>;
+	}
+
+	// Codes MCU's [first_mcu, end_mcu) of the currently loaded MCU row.
+	void jpeg_encoder::process_mcus(int first_mcu, int end_mcu)
+	{
+		if (m_yuv_direct)
+			process_yuv_mcus(first_mcu, end_mcu);
+		else
+			(this->*m_pCode_mcus[get_block_mode()])(first_mcu, end_mcu);
+	}
+
+	// Returns true if MCU row mcu_row isn't coded at all in the current pass, because it isn't one of the rows
+	// sampled for Huffman statistics. One row is sampled from each group of m_huff_sample_interval rows, at a
+	// pseudo-random position within the group, so periodic structure in the image can't bias the sample.
+	bool jpeg_encoder::skip_mcu_row(int mcu_row) const
+	{
+		if ((m_pass_num != 1) || (m_huff_sample_interval <= 1))
+			return false;
+		const uint group = mcu_row / m_huff_sample_interval;
+		return static_cast<uint>(mcu_row % m_huff_sample_interval) != (((group * 2654435761U) >> 16) % m_huff_sample_interval);
+	}
+
+	// Gives every valid symbol that wasn't seen in the sampled rows a count of 1, so it still gets a code.
+	void jpeg_encoder::smooth_huffman_counts()
+	{
+		for (int i = 0; i < 2; i++)
+		{
+			uint32* dc_count = m_huff_count[0 + i], * ac_count = m_huff_count[2 + i];
+			for (int j = 0; j < DC_LUM_CODES; j++)
+				dc_count[j] = JPGE_MAX(dc_count[j], 1U);
+			ac_count[0x00] = JPGE_MAX(ac_count[0x00], 1U);
+			ac_count[0xF0] = JPGE_MAX(ac_count[0xF0], 1U);
+			for (int run_len = 0; run_len < 16; run_len++)
+				for (int nbits = 1; nbits <= 10; nbits++)
+					ac_count[(run_len << 4) + nbits] = JPGE_MAX(ac_count[(run_len << 4) + nbits], 1U);
 		}
 	}
 
 	bool jpeg_encoder::terminate_pass_one()
 	{
+		if (m_pCoeffs)
+			return code_progressive_scans();
+		if (m_huff_sample_interval > 1)
+			smooth_huffman_counts();
 		optimize_huffman_table(0 + 0, DC_LUM_CODES); optimize_huffman_table(2 + 0, AC_LUM_CODES);
 		if (m_num_components > 1)
 		{
 			optimize_huffman_table(0 + 1, DC_CHROMA_CODES); optimize_huffman_table(2 + 1, AC_CHROMA_CODES);
 		}
-		return second_pass_init();
+		if (!second_pass_init()) return false;
+		if (m_pCoeff_cache)
+		{
+			if (!m_all_stream_writes_succeeded) return false;
+			code_cached_coefficients();
+			return terminate_pass_two();
+		}
+		return true;
 	}
 
 	bool jpeg_encoder::terminate_pass_two()
 	{
 		put_bits(0x7F, 7);
-		flush_output_buffer();
+		put_buffered_bytes(m_bits_in >> 3);
 		emit_marker(M_EOI);
+		flush_header();
 		m_pass_num++; // purposely bump up m_pass_num, for debugging
 		return true;
 	}
 
 	bool jpeg_encoder::process_end_of_image()
 	{
-		if (m_mcu_y_ofs)
+		if ((m_mcu_y_ofs) && (!skip_mcu_row(m_mcu_row)))
 		{
 			if (m_mcu_y_ofs < 16) // check here just to shut up static analysis
 			{
@@ -841,94 +2278,654 @@ namespace jpge {
 
 	void jpeg_encoder::load_mcu(const void* pSrc)
 	{
-		const uint8* Psrc = reinterpret_cast<const uint8*>(pSrc);
+		const bool skip = skip_mcu_row(m_mcu_row);
+		if (!skip)
+			load_mcu_line(reinterpret_cast<const uint8*>(pSrc), m_mcu_y_ofs, 0);
+
+		if (++m_mcu_y_ofs == m_mcu_y)
+		{
+			if (!skip)
+				process_mcu_row();
+			m_mcu_y_ofs = 0;
+			m_mcu_row++;
+		}
+	}
 
-		uint8* pDst = m_mcu_lines[m_mcu_y_ofs]; // OK to write up to m_image_bpl_xlt bytes to pDst
+	// Color converts source scanline pSrc, starting at pixel x_ofs, into MCU line y_ofs.
+	void jpeg_encoder::load_mcu_line(const uint8* pSrc, int y_ofs, int x_ofs)
+	{
+		const uint8* Psrc = pSrc + x_ofs * m_image_bpp;
+		const int num_pixels = m_image_x - x_ofs;
 
+		uint8* pLine = m_mcu_lines[y_ofs] + x_ofs;
 		if (m_num_components == 1)
+			(*m_pColor_convert)(pLine, NULL, NULL, Psrc, num_pixels);
+		else
+			(*m_pColor_convert)(pLine, pLine + m_image_x_mcu, pLine + m_image_x_mcu * 2, Psrc, num_pixels);
+		pad_mcu_line(m_mcu_lines[y_ofs]);
+	}
+
+	// Possibly duplicate pixels at end of scanline if not a multiple of 8 or 16
+	void jpeg_encoder::pad_mcu_line(uint8* pLine)
+	{
+		for (int c = 0; c < m_num_components; c++, pLine += m_image_x_mcu)
+			memset(pLine + m_image_x, pLine[m_image_x - 1], m_image_x_mcu - m_image_x);
+	}
+
+	// Copies scanline y of the YCbCr planes into MCU line y_ofs, from pixel x_ofs on, replicating the chroma samples.
+	// Only used when the planes don't match the MCU layout (see process_yuv_image()), so the output has 3 components.
+	void jpeg_encoder::load_yuv_mcu_line(int y, int y_ofs, int x_ofs)
+	{
+		const yuv_image& image = *m_pYUV;
+		const int step = (image.m_format == YUV_NV12) ? 2 : 1, cy = y >> m_yuv_v_shift;
+		const uint8* pY = image.m_pY + static_cast<ptrdiff_t>(y) * image.m_y_pitch;
+		const uint8* pCb = image.m_pCb + static_cast<ptrdiff_t>(cy) * image.m_cb_pitch;
+		const uint8* pCr = (step == 2) ? (pCb + 1) : (image.m_pCr + static_cast<ptrdiff_t>(cy) * image.m_cr_pitch);
+		uint8* pLine = m_mcu_lines[y_ofs];
+		memcpy(pLine + x_ofs, pY + x_ofs, m_image_x - x_ofs);
+		for (int x = x_ofs; x < m_image_x; x++)
 		{
-			if (m_image_bpp == 4)
-				RGBA_to_Y(pDst, Psrc, m_image_x);
-			else if (m_image_bpp == 3)
-				RGB_to_Y(pDst, Psrc, m_image_x);
-			else
-				memcpy(pDst, Psrc, m_image_x);
+			const int cx = (x >> m_yuv_h_shift) * step;
+			pLine[m_image_x_mcu + x] = pCb[cx]; pLine[m_image_x_mcu * 2 + x] = pCr[cx];
 		}
-		else
+		pad_mcu_line(pLine);
+	}
+
+	// Loads all the scanlines of MCU row mcu_row, duplicating the last scanline past the bottom of the image.
+	// Planar images read their blocks straight from the planes when they can, and only note the row.
+	void jpeg_encoder::load_mcu_row(const uint8* pImage, int mcu_row)
+	{
+		if (m_pYUV)
 		{
-			if (m_image_bpp == 4)
-				RGBA_to_YCC(pDst, Psrc, m_image_x);
-			else if (m_image_bpp == 3)
-				RGB_to_YCC(pDst, Psrc, m_image_x);
-			else
-				Y_to_YCC(pDst, Psrc, m_image_x);
+			m_yuv_mcu_row = mcu_row;
+			for (int i = 0; (i < m_mcu_y) && (!m_yuv_direct); i++)
+				load_yuv_mcu_line(JPGE_MIN(mcu_row * m_mcu_y + i, m_image_y - 1), i, 0);
+			return;
+		}
+		for (int i = 0; i < m_mcu_y; i++)
+		{
+			const int y = JPGE_MIN(mcu_row * m_mcu_y + i, m_image_y - 1);
+			load_mcu_line(pImage + static_cast<ptrdiff_t>(y) * m_image_pitch, i, 0);
 		}
+	}
 
-		// Possibly duplicate pixels at end of scanline if not a multiple of 8 or 16
-		if (m_num_components == 1)
-			memset(m_mcu_lines[m_mcu_y_ofs] + m_image_bpl_xlt, pDst[m_image_bpl_xlt - 1], m_image_x_mcu - m_image_x);
-		else
+	// Codes the last MCU of row mcu_row without writing anything, which leaves m_last_dc_val[] exactly as
+	// a sequential encoder would have it at the start of the next row. mcu_row must not be the last row.
+	// The block cache is bypassed, so the MCU's blocks aren't counted (or cached) as if this encoder had coded them.
+	void jpeg_encoder::seed_dc_predictors(const uint8* pImage, int mcu_row)
+	{
+		const int x_ofs = (m_mcus_per_row - 1) * m_mcu_x;
+		m_yuv_mcu_row = mcu_row;
+		for (int i = 0; i < m_mcu_y; i++)
+		{
+			if (!m_pYUV)
+				load_mcu_line(pImage + static_cast<ptrdiff_t>(mcu_row * m_mcu_y + i) * m_image_pitch, i, x_ofs);
+			else if (!m_yuv_direct)
+				load_yuv_mcu_line(mcu_row * m_mcu_y + i, i, x_ofs);
+		}
+
+		const uint8 pass_num = m_pass_num;
+		block_cache_entry* pBlock_cache = m_pBlock_cache;
+		m_pass_num = 0;
+		m_pBlock_cache = NULL;
+		process_mcus(m_mcus_per_row - 1, m_mcus_per_row);
+		m_pass_num = pass_num;
+		m_pBlock_cache = pBlock_cache;
+	}
+
+	// A band of MCU rows coded by a band worker. The coded data is split into one segment per restart interval,
+	// each starting on a byte boundary in m_stream. m_segment_bits holds the length in bits of each segment.
+	// When caching coefficients, the first pass caches the band's blocks in m_coeffs.
+	struct jpeg_encoder::mcu_band
+	{
+		int m_first_mcu_row, m_end_mcu_row;
+		uint m_segment_ofs;
+		band_stream m_stream;
+		band_stream m_segment_bits;
+		band_stream m_coeffs;
+	};
+
+	// The coded restart intervals of the last frame coded by process_dirty_image(). m_data[m_cur] holds the frame's
+	// entropy coded data (without the markers before the first scan and the EOI), and m_segments[m_cur] the start and
+	// end offsets of each interval's data in it. The other two are filled with the next frame.
+	struct jpeg_encoder::frame_cache
+	{
+		band_stream m_data[2];
+		band_stream m_segments[2];
+		band_stream m_dirty; // 1 byte per restart interval, set if it's coded again
+		int m_key[8];
+		uint m_cur;
+		bool m_valid;
+	};
+
+	// Prepares this encoder to code bands of MCU rows for the parent's current pass, using the parent's tables.
+	// Band workers don't write markers or stuff bytes, their output is appended to the parent's stream by put_raw_bits().
+	bool jpeg_encoder::init_band_worker(const jpeg_encoder& parent)
+	{
+		params band_params(parent.m_params);
+		band_params.m_two_pass_flag = true; // so jpg_open() doesn't emit any markers
+		band_params.m_num_threads = 0;
+		band_params.m_cache_coefficients_flag = false;
+		band_params.m_progressive_flag = false;
+		band_params.m_output_buffer_size = 0; // the bands are coded straight into their band_stream's
+		band_params.m_pipeline_flag = false;
+		if (!init(parent.m_pStream, parent.m_image_x, parent.m_image_y, parent.m_image_bpp, band_params))
+			return false;
+		m_pass_num = parent.m_pass_num;
+		m_image_pitch = parent.m_image_pitch;
+		m_pYUV = parent.m_pYUV;
+		m_yuv_direct = parent.m_yuv_direct;
+		m_yuv_h_shift = parent.m_yuv_h_shift;
+		m_yuv_v_shift = parent.m_yuv_v_shift;
+		m_huff_sample_interval = parent.m_huff_sample_interval;
+		memcpy(m_huff_codes, parent.m_huff_codes, sizeof(m_huff_codes));
+		memcpy(m_huff_code_sizes, parent.m_huff_code_sizes, sizeof(m_huff_code_sizes));
+		return true;
+	}
+
+	// Ends the band's current segment: pads it to a byte boundary with 0 bits and records its length.
+	void jpeg_encoder::end_band_segment()
+	{
+		const uint num_pad_bits = (8 - m_bits_in) & 7;
+		put_bits(0, num_pad_bits);
+		put_buffered_bytes(m_bits_in >> 3);
+		flush_output_buffer();
+		const uint num_bits = (m_pBand->m_stream.get_size() - m_pBand->m_segment_ofs) * 8 - num_pad_bits;
+		m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pBand->m_segment_bits.put_obj(num_bits);
+		m_pBand->m_segment_ofs = m_pBand->m_stream.get_size();
+	}
+
+	// Codes the band's MCU rows into its stream. The DC predictors and restart counters start out as a sequential
+	// encoder would have them, which only counts the rows skip_mcu_row() keeps.
+	void jpeg_encoder::encode_band(const uint8* pImage, mcu_band& band)
+	{
+		m_bit_buffer = 0; m_bits_in = 0;
+		memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
+		int prev_row = -1, num_prev_rows = 0;
+		for (int mcu_row = 0; mcu_row < band.m_first_mcu_row; mcu_row++)
 		{
-			const uint8 y = pDst[m_image_bpl_xlt - 3 + 0], cb = pDst[m_image_bpl_xlt - 3 + 1], cr = pDst[m_image_bpl_xlt - 3 + 2];
-			uint8* q = m_mcu_lines[m_mcu_y_ofs] + m_image_bpl_xlt;
-			for (int i = m_image_x; i < m_image_x_mcu; i++)
+			if (!skip_mcu_row(mcu_row))
 			{
-				*q++ = y; *q++ = cb; *q++ = cr;
+				prev_row = mcu_row;
+				num_prev_rows++;
 			}
 		}
+		if ((prev_row >= 0) && (!m_pCoeff_dst)) // progressive blocks are only stored, so the predictors don't matter
+			seed_dc_predictors(pImage, prev_row);
+		set_restart_state(num_prev_rows * m_mcus_per_row);
 
-		if (++m_mcu_y_ofs == m_mcu_y)
+		m_pStream = &band.m_stream;
+		m_pBand = &band;
+		for (int mcu_row = band.m_first_mcu_row; mcu_row < band.m_end_mcu_row; mcu_row++)
 		{
+			if (skip_mcu_row(mcu_row))
+				continue;
+			load_mcu_row(pImage, mcu_row);
 			process_mcu_row();
-			m_mcu_y_ofs = 0;
 		}
+		if (m_pass_num == 2)
+			end_band_segment();
+		m_pBand = NULL;
+	}
+
+	// Appends num_bits bits of already entropy coded (unstuffed) data, MSB first. If the output is on a byte boundary, as it
+	// is after a restart marker, the whole bytes are copied by put_stuffed_bytes() instead of being shifted into place.
+	void jpeg_encoder::put_raw_bits(const uint8* pBuf, uint num_bits)
+	{
+		if (!(m_bits_in & 7))
+		{
+			put_buffered_bytes(m_bits_in >> 3);
+			put_stuffed_bytes(pBuf, num_bits >> 3);
+			pBuf += num_bits >> 3;
+			num_bits &= 7;
+		}
+		for (; num_bits >= 16; num_bits -= 16, pBuf += 2)
+			put_bits((pBuf[0] << 8) | pBuf[1], 16);
+		if (num_bits >= 8)
+		{
+			put_bits(*pBuf++, 8);
+			num_bits -= 8;
+		}
+		if (num_bits)
+			put_bits(*pBuf >> (8 - num_bits), num_bits);
+	}
+
+	// Returns at least num_workers encoders to code bands or pipeline MCU rows with. They're kept until deinit(), so the
+	// next passes and images reuse their buffers and tables.
+	jpeg_encoder* jpeg_encoder::get_workers(int num_workers)
+	{
+		if (num_workers > m_num_workers)
+		{
+			delete[] m_pWorkers;
+			m_pWorkers = new jpeg_encoder[num_workers];
+			m_num_workers = num_workers;
+		}
+		return m_pWorkers;
+	}
+
+	// Runs the current pass on num_threads threads. The threads code whole bands of MCU rows into separate buffers,
+	// which are then appended to the output in order. In pass one the statistics of all the workers are summed instead.
+	bool jpeg_encoder::process_image_bands(const uint8* pImage, int num_threads)
+	{
+		const int num_mcu_rows = m_image_y_mcu / m_mcu_y;
+		const int num_bands = JPGE_MIN(num_mcu_rows, num_threads * 4);
+
+		jpeg_encoder* pWorkers = get_workers(num_threads);
+		if (num_bands > m_num_bands)
+		{
+			delete[] m_pBands;
+			m_pBands = new mcu_band[num_bands];
+			m_num_bands = num_bands;
+		}
+		mcu_band* pBands = m_pBands;
+
+		for (int i = 0; i < num_bands; i++)
+		{
+			pBands[i].m_first_mcu_row = (i * num_mcu_rows) / num_bands;
+			pBands[i].m_end_mcu_row = ((i + 1) * num_mcu_rows) / num_bands;
+			pBands[i].m_segment_ofs = 0;
+			pBands[i].m_stream.reset();
+			pBands[i].m_segment_bits.reset();
+			pBands[i].m_coeffs.reset();
+		}
+
+		bool status = true;
+		for (int i = 0; (i < num_threads) && (status); i++)
+			status = pWorkers[i].init_band_worker(*this);
+
+		if (status)
+		{
+			std::atomic<int> next_band(0);
+			auto worker_func = [&](jpeg_encoder* pWorker)
+			{
+				int band_index;
+				while ((band_index = next_band++) < num_bands)
+				{
+					if (m_pCoeff_cache)
+						pWorker->m_pCoeff_cache = &pBands[band_index].m_coeffs;
+					if (m_pCoeffs)
+						pWorker->m_pCoeff_dst = m_pCoeffs + static_cast<size_t>(pBands[band_index].m_first_mcu_row) * m_mcus_per_row * m_blocks_per_mcu * 64;
+					pWorker->encode_band(pImage, pBands[band_index]);
+					pWorker->m_pCoeff_cache = NULL;
+					pWorker->m_pCoeff_dst = NULL;
+				}
+			};
+
+			std::thread* pThreads = new std::thread[num_threads - 1];
+			for (int i = 0; i < num_threads - 1; i++)
+				pThreads[i] = std::thread(worker_func, &pWorkers[i + 1]);
+			worker_func(&pWorkers[0]);
+			for (int i = 0; i < num_threads - 1; i++)
+				pThreads[i].join();
+			delete[] pThreads;
+
+			for (int i = 0; i < num_threads; i++)
+			{
+				status = status && pWorkers[i].m_all_stream_writes_succeeded;
+				m_block_cache_hits += pWorkers[i].m_block_cache_hits;
+				m_block_cache_misses += pWorkers[i].m_block_cache_misses;
+			}
+		}
+
+		if (status)
+		{
+			if (m_pass_num == 1)
+			{
+				for (int i = 0; i < num_threads; i++)
+					for (int j = 0; j < 4; j++)
+						for (int k = 0; k < 256; k++)
+							m_huff_count[j][k] += pWorkers[i].m_huff_count[j][k];
+				for (int i = 0; (i < num_bands) && (m_pCoeff_cache); i++)
+					status = status && m_pCoeff_cache->put_buf(pBands[i].m_coeffs.get_buf(), pBands[i].m_coeffs.get_size());
+			}
+			else
+			{
+				for (int i = 0; i < num_bands; i++)
+				{
+					const uint8* pData = pBands[i].m_stream.get_buf();
+					const uint* pSegment_bits = reinterpret_cast<const uint*>(pBands[i].m_segment_bits.get_buf());
+					const uint num_segments = pBands[i].m_segment_bits.get_size() / sizeof(uint);
+					for (uint j = 0; j < num_segments; j++)
+					{
+						if (j)
+							emit_restart();
+						put_raw_bits(pData, pSegment_bits[j]);
+						pData += (pSegment_bits[j] + 7) >> 3;
+					}
+				}
+			}
+		}
+
+		return status;
+	}
+
+	// Runs the current pass on two threads: a worker loads, transforms and quantizes the MCU rows into a ring of
+	// JPGE_PIPELINE_ROWS rows (in m_pCoeff_buf), while this thread entropy codes them in order.
+	bool jpeg_encoder::process_image_pipelined(const uint8* pImage)
+	{
+		const int num_mcu_rows = m_image_y_mcu / m_mcu_y;
+		const size_t row_size = static_cast<size_t>(m_mcus_per_row) * m_blocks_per_mcu * 64;
+		jpeg_encoder* pWorker = get_workers(1);
+		if (!pWorker->init_band_worker(*this))
+			return false;
+		pWorker->m_restart_interval = 0; // the restarts are coded by this thread
+
+		int num_rows = 0;
+		for (int mcu_row = 0; mcu_row < num_mcu_rows; mcu_row++)
+			num_rows += !skip_mcu_row(mcu_row);
+
+		// Only the worker changes num_loaded, and only this thread changes num_coded.
+		std::mutex mutex;
+		std::condition_variable cond;
+		int num_loaded = 0, num_coded = 0;
+		bool abort = false;
+		std::thread worker([&]
+		{
+			for (int mcu_row = 0; mcu_row < num_mcu_rows; mcu_row++)
+			{
+				if (pWorker->skip_mcu_row(mcu_row))
+					continue;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					cond.wait(lock, [&] { return (num_loaded - num_coded < JPGE_PIPELINE_ROWS) || (abort); });
+					if (abort)
+						break;
+				}
+				pWorker->m_pCoeff_dst = m_pCoeff_buf + (num_loaded % JPGE_PIPELINE_ROWS) * row_size;
+				pWorker->load_mcu_row(pImage, mcu_row);
+				pWorker->process_mcu_row();
+				std::lock_guard<std::mutex> lock(mutex);
+				num_loaded++;
+				cond.notify_one();
+			}
+		});
+
+		while ((num_coded < num_rows) && (m_all_stream_writes_succeeded))
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cond.wait(lock, [&] { return num_loaded > num_coded; });
+			}
+			const int16* pRow = m_pCoeff_buf + (num_coded % JPGE_PIPELINE_ROWS) * row_size;
+			if (m_pass_num == 1)
+				code_mcu_row_coefficients<BLOCK_PASS_ONE>(pRow);
+			else
+				code_mcu_row_coefficients<BLOCK_PASS_TWO>(pRow);
+			std::lock_guard<std::mutex> lock(mutex);
+			num_coded++;
+			cond.notify_one();
+		}
+		if (num_coded < num_rows)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			abort = true;
+			cond.notify_one();
+		}
+		worker.join();
+		m_block_cache_hits += pWorker->m_block_cache_hits;
+		m_block_cache_misses += pWorker->m_block_cache_misses;
+		return m_all_stream_writes_succeeded;
 	}
 
 	void jpeg_encoder::clear()
 	{
 		m_mcu_lines[0] = NULL;
+		m_mcu_lines_size = 0;
+		m_pOut_buf_alloc = NULL;
+		m_out_buf_alloc_size = 0;
+		m_header_cache_size = 0;
+		m_pOut_buf_start = m_pOut_buf = NULL;
+		m_out_buf_left = 0;
+		m_out_buf_in_stream = false;
+		m_pCoeff_buf = NULL;
+		m_coeffs_size = 0;
+		m_pCoeff_cache_buf = NULL;
+		m_quant_key = -1;
+		m_std_huff_tables = false;
+		m_pBlock_cache = NULL;
+		m_block_cache_size = 0;
+		m_pFrame_cache = NULL;
+		m_pWorkers = NULL;
+		m_num_workers = 0;
+		m_pBands = NULL;
+		m_num_bands = 0;
+		reset();
+	}
+
+	// Resets the state of the current image, keeping the buffers and tables.
+	void jpeg_encoder::reset()
+	{
 		m_pass_num = 0;
+		m_header_size = 0;
 		m_all_stream_writes_succeeded = true;
+		m_pBand = NULL;
+		m_pCoeff_cache = NULL;
+		m_pCoeffs = NULL;
+		m_pCoeff_dst = NULL;
+		m_pYUV = NULL;
+		m_yuv_direct = false;
+		m_yuv_h_shift = m_yuv_v_shift = 0;
+		m_yuv_mcu_row = 0;
+		m_block_cache_hits = m_block_cache_misses = 0;
+	}
+
+	jpeg_encoder::jpeg_encoder()
+	{
+		clear();
+	}
+
+	jpeg_encoder::~jpeg_encoder()
+	{
+		deinit();
+	}
+
+	bool jpeg_encoder::init(output_stream* pStream, int width, int height, int src_channels, const params& comp_params)
+	{
+		reset();
+		if (((!pStream) || (width < 1) || (height < 1)) || ((src_channels != 1) && (src_channels != 3) && (src_channels != 4)) || (!comp_params.check())) return false;
+		if ((comp_params.m_pixel_format != PF_DEFAULT) && (get_pixel_format_bpp(comp_params.m_pixel_format) != src_channels)) return false;
+		m_pStream = pStream;
+		m_params = comp_params;
+		if ((m_params.m_progressive_flag) && (m_params.m_pScan_script) && (!check_scan_script(m_params.m_pScan_script, m_params.m_num_scans, (m_params.m_subsampling == Y_ONLY) ? 1 : 3))) return false;
+		return jpg_open(width, height, src_channels);
+	}
+
+	void jpeg_encoder::deinit()
+	{
+		jpge_free(m_mcu_lines[0]);
+		jpge_free(m_pOut_buf_alloc);
+		delete m_pCoeff_cache_buf;
+		jpge_free(m_pCoeff_buf);
+		jpge_free(m_pBlock_cache);
+		delete m_pFrame_cache;
+		delete[] m_pWorkers;
+		delete[] m_pBands;
+		clear();
+	}
+
+	bool jpeg_encoder::process_scanline(const void* pScanline)
+	{
+		if ((m_pass_num < 1) || (m_pass_num > 2)) return false;
+		if (m_all_stream_writes_succeeded)
+		{
+			if (!pScanline)
+			{
+				if (!process_end_of_image()) return false;
+			}
+			else
+			{
+				load_mcu(pScanline);
+			}
+		}
+		return m_all_stream_writes_succeeded;
 	}
 
-	jpeg_encoder::jpeg_encoder()
+	bool jpeg_encoder::process_image(const void* pImage_data)
 	{
-		clear();
+		return process_image(pImage_data, m_image_bpl);
 	}
 
-	jpeg_encoder::~jpeg_encoder()
+	bool jpeg_encoder::process_image(const void* pImage_data, int pitch)
 	{
-		deinit();
+		if ((m_pass_num < 1) || (m_pass_num > 2) || (m_mcu_y_ofs) || (!pImage_data) || (JPGE_MAX(pitch, -pitch) < m_image_bpl)) return false;
+		m_image_pitch = pitch;
+		return encode_image(static_cast<const uint8*>(pImage_data));
 	}
 
-	bool jpeg_encoder::init(output_stream* pStream, int width, int height, int src_channels, const params& comp_params)
+	bool jpeg_encoder::process_yuv_image(const yuv_image& image)
 	{
-		deinit();
-		if (((!pStream) || (width < 1) || (height < 1)) || ((src_channels != 1) && (src_channels != 3) && (src_channels != 4)) || (!comp_params.check())) return false;
-		m_pStream = pStream;
-		m_params = comp_params;
-		return jpg_open(width, height, src_channels);
+		if ((m_pass_num < 1) || (m_pass_num > 2) || (m_mcu_y_ofs) || (image.m_format < YUV_I420) || (image.m_format > YUV_I444)) return false;
+		const int h_shift = (image.m_format != YUV_I444) ? 1 : 0, v_shift = ((image.m_format == YUV_I420) || (image.m_format == YUV_NV12)) ? 1 : 0;
+		const int chroma_x = (m_image_x + (1 << h_shift) - 1) >> h_shift;
+		if ((!image.m_pY) || (JPGE_MAX(image.m_y_pitch, -image.m_y_pitch) < m_image_x)) return false;
+		if (image.m_format == YUV_NV12)
+		{
+			if ((!image.m_pCb) || (JPGE_MAX(image.m_cb_pitch, -image.m_cb_pitch) < chroma_x * 2)) return false;
+		}
+		else if ((!image.m_pCb) || (!image.m_pCr) || (JPGE_MAX(image.m_cb_pitch, -image.m_cb_pitch) < chroma_x) || (JPGE_MAX(image.m_cr_pitch, -image.m_cr_pitch) < chroma_x))
+			return false;
+
+		m_pYUV = &image;
+		m_yuv_h_shift = static_cast<uint8>(h_shift);
+		m_yuv_v_shift = static_cast<uint8>(v_shift);
+		m_yuv_direct = (m_num_components == 1) || ((m_comp_h_samp[0] == (1 << h_shift)) && (m_comp_v_samp[0] == (1 << v_shift)));
+		const bool status = encode_image(NULL);
+		m_pYUV = NULL;
+		m_yuv_direct = false;
+		return status;
 	}
 
-	void jpeg_encoder::deinit()
+	bool jpeg_encoder::process_dirty_image(const void* pImage_data, int pitch, int dirty_x, int dirty_y, int dirty_width, int dirty_height)
 	{
-		jpge_free(m_mcu_lines[0]);
-		clear();
+		if ((m_pass_num != 2) || (m_mcu_y_ofs) || (!pImage_data) || (JPGE_MAX(pitch, -pitch) < m_image_bpl)) return false;
+		if ((!m_restart_interval) || (m_params.m_two_pass_flag) || (m_params.m_progressive_flag)) return false;
+		if (!m_pFrame_cache)
+		{
+			m_pFrame_cache = new frame_cache;
+			m_pFrame_cache->m_cur = 0;
+			m_pFrame_cache->m_valid = false;
+		}
+		frame_cache& frame = *m_pFrame_cache;
+		const uint num_mcus = static_cast<uint>(m_mcus_per_row) * (m_image_y_mcu / m_mcu_y);
+		const uint num_intervals = (num_mcus + m_restart_interval - 1) / m_restart_interval;
+
+		// Mark the intervals to code: all of them, unless the last frame can be reused.
+		const int key[8] = { m_image_x, m_image_y, m_params.m_subsampling, m_quant_key, static_cast<int>(m_restart_interval), m_image_bpp, m_params.m_pixel_format, m_params.m_flat_block_threshold };
+		const bool reuse = (frame.m_valid) && (!memcmp(key, frame.m_key, sizeof(key)));
+		frame.m_valid = false; // until this frame is complete
+		frame.m_dirty.reset();
+		uint8* pDirty = frame.m_dirty.append(num_intervals);
+		if (!pDirty) return false;
+		memset(pDirty, !reuse, num_intervals);
+		if ((reuse) && (dirty_width > 0) && (dirty_height > 0) && (dirty_x < m_image_x) && (dirty_y < m_image_y) && (dirty_x > -dirty_width) && (dirty_y > -dirty_height))
+		{
+			const int x0 = JPGE_MAX(dirty_x, 0), x1 = (dirty_x > m_image_x - dirty_width) ? m_image_x : (dirty_x + dirty_width);
+			const int y0 = JPGE_MAX(dirty_y, 0), y1 = (dirty_y > m_image_y - dirty_height) ? m_image_y : (dirty_y + dirty_height);
+			for (int mcu_row = y0 / m_mcu_y; mcu_row <= (y1 - 1) / m_mcu_y; mcu_row++)
+			{
+				const uint first = (static_cast<uint>(mcu_row) * m_mcus_per_row + x0 / m_mcu_x) / m_restart_interval;
+				const uint last = (static_cast<uint>(mcu_row) * m_mcus_per_row + (x1 - 1) / m_mcu_x) / m_restart_interval;
+				memset(pDirty + first, 1, last - first + 1);
+			}
+		}
+
+		// Code the frame into m_data[m_cur ^ 1] one interval at a time, copying the clean ones from the last frame.
+		const uint8* pImage = static_cast<const uint8*>(pImage_data);
+		const uint8* pPrev_data = frame.m_data[frame.m_cur].get_buf();
+		const uint* pPrev_segments = reinterpret_cast<const uint*>(frame.m_segments[frame.m_cur].get_buf());
+		band_stream& data = frame.m_data[frame.m_cur ^ 1];
+		band_stream& segments = frame.m_segments[frame.m_cur ^ 1];
+		data.reset();
+		segments.reset();
+		output_stream* pStream = m_pStream;
+		m_pStream = &data;
+		m_image_pitch = pitch;
+		int loaded_row = -1, loaded_mcu = 0;
+		for (uint i = 0; (i < num_intervals) && (m_all_stream_writes_succeeded); i++)
+		{
+			if (i)
+				put_marker_bytes(M_RST0 + ((i - 1) & 7));
+			flush_output_buffer();
+			const uint start = data.get_size();
+			if (pDirty[i])
+			{
+				memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
+				m_restart_mcus_left = m_restart_interval;
+				const uint end = JPGE_MIN((i + 1) * m_restart_interval, num_mcus);
+				for (uint mcu = i * m_restart_interval; mcu < end; )
+				{
+					const int mcu_row = mcu / m_mcus_per_row, first_mcu = mcu % m_mcus_per_row;
+					const int end_mcu = static_cast<int>(JPGE_MIN(first_mcu + end - mcu, static_cast<uint>(m_mcus_per_row)));
+					if ((mcu_row != loaded_row) || (first_mcu < loaded_mcu))
+					{
+						for (int j = 0; j < m_mcu_y; j++)
+						{
+							const int y = JPGE_MIN(mcu_row * m_mcu_y + j, m_image_y - 1);
+							load_mcu_line(pImage + static_cast<ptrdiff_t>(y) * m_image_pitch, j, first_mcu * m_mcu_x);
+						}
+						loaded_row = mcu_row;
+						loaded_mcu = first_mcu;
+					}
+					process_mcus(first_mcu, end_mcu);
+					mcu += end_mcu - first_mcu;
+				}
+				put_bits(0x7F, 7);
+				put_buffered_bytes(m_bits_in >> 3);
+				m_bit_buffer = 0; m_bits_in = 0;
+				flush_output_buffer();
+			}
+			else
+				m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && data.put_buf(pPrev_data + pPrev_segments[i * 2], pPrev_segments[i * 2 + 1] - pPrev_segments[i * 2]);
+			const uint segment[2] = { start, data.get_size() };
+			m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && segments.put_obj(segment);
+		}
+		m_pStream = pStream;
+		if (!m_all_stream_writes_succeeded) return false;
+
+		m_all_stream_writes_succeeded = m_pStream->put_buf(data.get_buf(), data.get_size());
+		emit_marker(M_EOI);
+		flush_header();
+		m_pass_num++;
+		if (!m_all_stream_writes_succeeded) return false;
+		frame.m_cur ^= 1;
+		memcpy(frame.m_key, key, sizeof(key));
+		frame.m_valid = true;
+		return true;
 	}
 
-	bool jpeg_encoder::process_scanline(const void* pScanline)
+	// Runs the remaining passes over the image (pImage is NULL for planar YCbCr images, see m_pYUV).
+	bool jpeg_encoder::encode_image(const uint8* pImage)
 	{
-		if ((m_pass_num < 1) || (m_pass_num > 2)) return false;
-		if (m_all_stream_writes_succeeded)
+		const int num_mcu_rows = m_image_y_mcu / m_mcu_y;
+		const int num_threads = JPGE_MIN(m_params.m_num_threads, num_mcu_rows);
+
+		while ((m_all_stream_writes_succeeded) && (m_pass_num <= 2))
 		{
-			if (!pScanline)
+			if (num_threads > 1)
 			{
-				if (!process_end_of_image()) return false;
+				if (!process_image_bands(pImage, num_threads))
+					return false;
+			}
+			else if ((m_params.m_pipeline_flag) && (!m_pCoeffs))
+			{
+				if (!process_image_pipelined(pImage))
+					return false;
 			}
 			else
 			{
-				load_mcu(pScanline);
+				for (int mcu_row = 0; mcu_row < num_mcu_rows; mcu_row++)
+				{
+					if (skip_mcu_row(mcu_row))
+						continue;
+					load_mcu_row(pImage, mcu_row);
+					process_mcu_row();
+				}
 			}
+
+			if (m_pass_num == 1)
+				terminate_pass_one();
+			else
+				terminate_pass_two();
 		}
 		return m_all_stream_writes_succeeded;
 	}
@@ -985,8 +2982,170 @@ namespace jpge {
 		}
 	};
 
+	// The state of an async_file_stream. The buffers form a ring: the stream fills m_pBufs[m_fill_index], and the
+	// thread writes the m_num_queued ones starting at m_write_index.
+	struct async_file_stream::file_writer
+	{
+		FILE* m_pFile;
+		uint8** m_pBufs;
+		uint* m_buf_sizes;
+		uint m_buf_size, m_num_bufs;
+		uint m_fill_index, m_fill_size, m_write_index, m_num_queued;
+		std::atomic<bool> m_status;
+		bool m_exit_flag;
+		std::mutex m_mutex;
+		std::condition_variable m_queued_cond, m_written_cond;
+		std::thread m_thread;
+
+		void thread_func()
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			for (; ; )
+			{
+				m_queued_cond.wait(lock, [&] { return (m_num_queued) || (m_exit_flag); });
+				if (!m_num_queued)
+					break;
+				const uint buf_index = m_write_index;
+				lock.unlock();
+				const bool status = fwrite(m_pBufs[buf_index], m_buf_sizes[buf_index], 1, m_pFile) == 1;
+				lock.lock();
+				m_status = m_status && status;
+				m_write_index = (m_write_index + 1) % m_num_bufs;
+				m_num_queued--;
+				m_written_cond.notify_one();
+			}
+		}
+
+		// Queues the buffer being filled for writing, waiting for a free one to fill next.
+		void submit()
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_buf_sizes[m_fill_index] = m_fill_size;
+			m_num_queued++;
+			m_queued_cond.notify_one();
+			m_written_cond.wait(lock, [&] { return m_num_queued < m_num_bufs; });
+			m_fill_index = (m_fill_index + 1) % m_num_bufs;
+			m_fill_size = 0;
+		}
+	};
+
+	async_file_stream::async_file_stream() : m_pWriter(NULL)
+	{
+	}
+
+	async_file_stream::~async_file_stream()
+	{
+		close();
+	}
+
+	bool async_file_stream::open(const char* pFilename, uint buffer_size, uint num_buffers)
+	{
+		close();
+		if ((!buffer_size) || (num_buffers < 2))
+			return false;
+		FILE* pFile = fopen(pFilename, "wb");
+		if (!pFile)
+			return false;
+		setvbuf(pFile, NULL, _IONBF, 0); // the writes are already large
+
+		m_pWriter = new file_writer;
+		file_writer& writer = *m_pWriter;
+		writer.m_pFile = pFile;
+		writer.m_buf_size = buffer_size;
+		writer.m_num_bufs = num_buffers;
+		writer.m_fill_index = 0;
+		writer.m_fill_size = 0;
+		writer.m_write_index = 0;
+		writer.m_num_queued = 0;
+		writer.m_status = true;
+		writer.m_exit_flag = false;
+		writer.m_buf_sizes = new uint[num_buffers];
+		writer.m_pBufs = new uint8*[num_buffers];
+		for (uint i = 0; i < num_buffers; i++)
+			writer.m_status = ((writer.m_pBufs[i] = static_cast<uint8*>(jpge_malloc(buffer_size))) != NULL) && (writer.m_status);
+		if (!writer.m_status)
+		{
+			close();
+			return false;
+		}
+		writer.m_thread = std::thread(&file_writer::thread_func, m_pWriter);
+		return true;
+	}
+
+	bool async_file_stream::close()
+	{
+		if (!m_pWriter)
+			return false;
+		file_writer& writer = *m_pWriter;
+		if (writer.m_thread.joinable())
+		{
+			if (writer.m_fill_size)
+				writer.submit();
+			{
+				std::lock_guard<std::mutex> lock(writer.m_mutex);
+				writer.m_exit_flag = true;
+			}
+			writer.m_queued_cond.notify_one();
+			writer.m_thread.join();
+		}
+		bool status = writer.m_status;
+		if (fclose(writer.m_pFile) == EOF)
+			status = false;
+		for (uint i = 0; i < writer.m_num_bufs; i++)
+			jpge_free(writer.m_pBufs[i]);
+		delete[] writer.m_pBufs;
+		delete[] writer.m_buf_sizes;
+		delete m_pWriter;
+		m_pWriter = NULL;
+		return status;
+	}
+
+	bool async_file_stream::put_buf(const void* pBuf, int len)
+	{
+		if ((!m_pWriter) || (len < 0))
+			return false;
+		file_writer& writer = *m_pWriter;
+		const uint8* pSrc = static_cast<const uint8*>(pBuf);
+		while (len)
+		{
+			const uint n = JPGE_MIN((uint)len, writer.m_buf_size - writer.m_fill_size);
+			memcpy(writer.m_pBufs[writer.m_fill_index] + writer.m_fill_size, pSrc, n);
+			pSrc += n;
+			len -= n;
+			if ((writer.m_fill_size += n) == writer.m_buf_size)
+				writer.submit();
+		}
+		return writer.m_status;
+	}
+
+	uint8* async_file_stream::get_write_buffer(uint min_size, uint& size)
+	{
+		if ((!m_pWriter) || (min_size > m_pWriter->m_buf_size))
+			return NULL;
+		file_writer& writer = *m_pWriter;
+		if (writer.m_buf_size - writer.m_fill_size < min_size)
+			writer.submit();
+		size = writer.m_buf_size - writer.m_fill_size;
+		return writer.m_pBufs[writer.m_fill_index] + writer.m_fill_size;
+	}
+
+	bool async_file_stream::commit(uint size)
+	{
+		if (!m_pWriter)
+			return false;
+		file_writer& writer = *m_pWriter;
+		if ((writer.m_fill_size += size) == writer.m_buf_size)
+			writer.submit();
+		return writer.m_status;
+	}
+
 	// Writes JPEG image to file.
 	bool compress_image_to_jpeg_file(const char* pFilename, int width, int height, int num_channels, const uint8* pImage_data, const params& comp_params)
+	{
+		return compress_image_to_jpeg_file(pFilename, width, height, num_channels, pImage_data, width * num_channels, comp_params);
+	}
+
+	bool compress_image_to_jpeg_file(const char* pFilename, int width, int height, int num_channels, const uint8* pImage_data, int pitch, const params& comp_params)
 	{
 		cfile_stream dst_stream;
 		if (!dst_stream.open(pFilename))
@@ -996,17 +3155,26 @@ namespace jpge {
 		if (!dst_image.init(&dst_stream, width, height, num_channels, comp_params))
 			return false;
 
-		for (uint pass_index = 0; pass_index < dst_image.get_total_passes(); pass_index++)
-		{
-			for (int i = 0; i < height; i++)
-			{
-				const uint8* pBuf = pImage_data + i * width * num_channels;
-				if (!dst_image.process_scanline(pBuf))
-					return false;
-			}
-			if (!dst_image.process_scanline(NULL))
-				return false;
-		}
+		if (!dst_image.process_image(pImage_data, pitch))
+			return false;
+
+		dst_image.deinit();
+
+		return dst_stream.close();
+	}
+
+	bool compress_yuv_image_to_jpeg_file(const char* pFilename, int width, int height, const yuv_image& image, const params& comp_params)
+	{
+		cfile_stream dst_stream;
+		if (!dst_stream.open(pFilename))
+			return false;
+
+		jpge::jpeg_encoder dst_image;
+		if (!dst_image.init(&dst_stream, width, height, 3, comp_params))
+			return false;
+
+		if (!dst_image.process_yuv_image(image))
+			return false;
 
 		dst_image.deinit();
 
@@ -1036,13 +3204,166 @@ namespace jpge {
 			return true;
 		}
 
+		virtual uint8* get_write_buffer(uint min_size, uint& size)
+		{
+			size = m_buf_size - m_buf_ofs;
+			return (size >= min_size) ? (m_pBuf + m_buf_ofs) : NULL;
+		}
+
+		virtual bool commit(uint size)
+		{
+			m_buf_ofs += size;
+			return true;
+		}
+
 		uint get_size() const
 		{
 			return m_buf_ofs;
 		}
 	};
 
+	growable_memory_stream::growable_memory_stream(size_t initial_size) : m_pBuf(NULL), m_buf_size(0), m_buf_ofs(0), m_initial_size(JPGE_MAX(initial_size, (size_t)256))
+	{
+	}
+
+	growable_memory_stream::~growable_memory_stream()
+	{
+		jpge_free(m_pBuf);
+	}
+
+	bool growable_memory_stream::put_buf(const void* pBuf, int len)
+	{
+		uint size;
+		if ((len < 0) || (!get_write_buffer(len, size)))
+			return false;
+		memcpy(m_pBuf + m_buf_ofs, pBuf, len);
+		m_buf_ofs += len;
+		return true;
+	}
+
+	uint8* growable_memory_stream::get_write_buffer(uint min_size, uint& size)
+	{
+		if (m_buf_ofs + min_size > m_buf_size)
+		{
+			const size_t new_size = JPGE_MAX(JPGE_MAX(m_buf_size * 2, m_buf_ofs + min_size), m_initial_size);
+			uint8* pNew_buf = static_cast<uint8*>(jpge_realloc(m_pBuf, new_size));
+			if (!pNew_buf)
+				return NULL;
+			m_pBuf = pNew_buf;
+			m_buf_size = new_size;
+		}
+		size = static_cast<uint>(JPGE_MIN(m_buf_size - m_buf_ofs, (size_t)0x7FFFFFFF));
+		return m_pBuf + m_buf_ofs;
+	}
+
+	bool growable_memory_stream::commit(uint size)
+	{
+		m_buf_ofs += size;
+		return true;
+	}
+
+	uint8* growable_memory_stream::detach()
+	{
+		uint8* pBuf = m_pBuf;
+		m_pBuf = NULL;
+		m_buf_size = 0;
+		m_buf_ofs = 0;
+		return pBuf;
+	}
+
+	// Returns the length of the longest code of a Huffman table.
+	static int get_max_code_size(const uint8* pBits)
+	{
+		int i = 16;
+		while ((i > 1) && (!pBits[i]))
+			i--;
+		return i;
+	}
+
+	// Returns an upper bound on the number of bits of one block in a scan, with Huffman codes of at most dc_code_size and
+	// ac_code_size bits. 8-bit samples give coefficients of at most 1024 in magnitude, so each coefficient costs at most
+	// a code plus the magnitude bits of 1024 / q (ZRL codes cost less than the zero coefficients they stand for). Every
+	// AC scan may also end the block with an EOB run code, and refinement scans add correction bits.
+	static uint64 get_max_block_bits(const int32* pQuant, const scan_info& scan, int dc_code_size, int ac_code_size)
+	{
+		uint64 num_bits = 0;
+		if (!scan.m_Se)
+		{
+			const uint max_dc = (1024 + pQuant[0] / 2) / pQuant[0];
+			return scan.m_Ah ? 1 : (dc_code_size + get_num_bits((max_dc * 2) >> scan.m_Al) + 1);
+		}
+		for (int i = scan.m_Ss; i <= scan.m_Se; i++)
+		{
+			const uint max_ac = (1024 + pQuant[i] / 2) / pQuant[i];
+			num_bits += ac_code_size + (scan.m_Ah ? 2 : get_num_bits(max_ac >> scan.m_Al));
+		}
+		return num_bits + ac_code_size + 14;
+	}
+
+	size_t get_max_compressed_size(int width, int height, int num_channels, const params& comp_params)
+	{
+		if ((width < 1) || (height < 1) || ((num_channels != 1) && (num_channels != 3) && (num_channels != 4)) || (!comp_params.check()))
+			return 0;
+		const int num_components = (comp_params.m_subsampling == Y_ONLY) ? 1 : 3;
+		const int mcu_x = (comp_params.m_subsampling >= H2V1) ? 16 : 8, mcu_y = (comp_params.m_subsampling == H2V2) ? 16 : 8;
+		const int mcus_per_row = (width + mcu_x - 1) / mcu_x;
+		const uint64 num_mcus = static_cast<uint64>(mcus_per_row) * ((height + mcu_y - 1) / mcu_y);
+		const int blocks_per_mcu[3] = { (mcu_x / 8) * (mcu_y / 8), 1, 1 };
+		const int restart_interval = comp_params.m_restart_per_mcu_row_flag ? mcus_per_row : comp_params.m_restart_interval;
+
+		int32 quant_tables[2][64];
+		compute_quant_tables(quant_tables, comp_params);
+
+		const scan_info baseline_scan = { num_components, { 0, 1, 2 }, 0, 63, 0, 0 };
+		const scan_info* pScans = &baseline_scan;
+		int num_scans = 1;
+		if (comp_params.m_progressive_flag)
+		{
+			pScans = comp_params.m_pScan_script;
+			num_scans = comp_params.m_num_scans;
+			if (!pScans)
+			{
+				pScans = (num_components == 1) ? s_progressive_y_scans : s_progressive_ycc_scans;
+				num_scans = (num_components == 1) ? (sizeof(s_progressive_y_scans) / sizeof(scan_info)) : (sizeof(s_progressive_ycc_scans) / sizeof(scan_info));
+			}
+			else if (!check_scan_script(pScans, num_scans, num_components))
+				return 0;
+		}
+
+		// Single pass baseline images use the standard Huffman tables, the others optimized ones with codes of up to 16 bits.
+		const bool std_tables = (!comp_params.m_progressive_flag) && (!comp_params.m_two_pass_flag);
+		const int dc_code_size[2] = { std_tables ? get_max_code_size(s_dc_lum_bits) : 16, std_tables ? get_max_code_size(s_dc_chroma_bits) : 16 };
+		const int ac_code_size[2] = { std_tables ? get_max_code_size(s_ac_lum_bits) : 16, std_tables ? get_max_code_size(s_ac_chroma_bits) : 16 };
+
+		// SOI, APP0, DQT, SOF, DRI and EOI markers.
+		uint64 size = 2 + 18 + 69 * ((num_components == 3) ? 2 : 1) + 10 + 3 * num_components + 6 + 2;
+		for (int i = 0; i < num_scans; i++)
+		{
+			const scan_info& scan = pScans[i];
+			uint64 num_bits = 0, num_units = 0;
+			for (int j = 0; j < scan.m_num_comps; j++)
+			{
+				const int c = scan.m_comp_index[j], t = c > 0;
+				num_bits += num_mcus * blocks_per_mcu[c] * get_max_block_bits(quant_tables[t], scan, dc_code_size[t], ac_code_size[t]);
+				num_units = JPGE_MAX(num_units, (scan.m_num_comps > 1) ? num_mcus : num_mcus * blocks_per_mcu[c]);
+			}
+			const uint64 num_restarts = restart_interval ? (num_units / restart_interval) : 0;
+
+			// DHT (up to 4 tables of at most 17 + 256 bytes) and SOS markers, then the entropy coded data, where each
+			// byte may need a stuffed 0 byte, padded at the end and before each RSTn marker.
+			size += 4 * (5 + 17 + 256) + 8 + 2 * scan.m_num_comps;
+			size += ((num_bits + 7) / 8 + 1) * 2;
+			size += num_restarts * (2 + (2 + (ac_code_size[0] + 14 + 7) / 8) * 2);
+		}
+		return (size > (size_t)-1) ? 0 : static_cast<size_t>(size);
+	}
+
 	bool compress_image_to_jpeg_file_in_memory(void* pDstBuf, int& buf_size, int width, int height, int num_channels, const uint8* pImage_data, const params& comp_params)
+	{
+		return compress_image_to_jpeg_file_in_memory(pDstBuf, buf_size, width, height, num_channels, pImage_data, width * num_channels, comp_params);
+	}
+
+	bool compress_image_to_jpeg_file_in_memory(void* pDstBuf, int& buf_size, int width, int height, int num_channels, const uint8* pImage_data, int pitch, const params& comp_params)
 	{
 		if ((!pDstBuf) || (!buf_size))
 			return false;
@@ -1055,22 +3376,182 @@ namespace jpge {
 		if (!dst_image.init(&dst_stream, width, height, num_channels, comp_params))
 			return false;
 
-		for (uint pass_index = 0; pass_index < dst_image.get_total_passes(); pass_index++)
+		if (!dst_image.process_image(pImage_data, pitch))
+			return false;
+
+		dst_image.deinit();
+
+		buf_size = dst_stream.get_size();
+		return true;
+	}
+
+	uint8* compress_image_to_jpeg_file_in_memory_alloc(int& buf_size, int width, int height, int num_channels, const uint8* pImage_data, int pitch, const params& comp_params)
+	{
+		buf_size = 0;
+
+		// Start with room for about 1 bit per pixel, a typical size.
+		growable_memory_stream dst_stream(4096 + static_cast<size_t>(width) * JPGE_MAX(height, 0) / 8);
+
+		jpge::jpeg_encoder dst_image;
+		if (!dst_image.init(&dst_stream, width, height, num_channels, comp_params))
+			return NULL;
+
+		if (!dst_image.process_image(pImage_data, pitch ? pitch : width * num_channels))
+			return NULL;
+
+		dst_image.deinit();
+
+		if (dst_stream.get_size() > 0x7FFFFFFF)
+			return NULL;
+		buf_size = static_cast<int>(dst_stream.get_size());
+		return dst_stream.detach();
+	}
+
+	bool compress_yuv_image_to_jpeg_file_in_memory(void* pDstBuf, int& buf_size, int width, int height, const yuv_image& image, const params& comp_params)
+	{
+		if ((!pDstBuf) || (!buf_size))
+			return false;
+
+		memory_stream dst_stream(pDstBuf, buf_size);
+
+		buf_size = 0;
+
+		jpge::jpeg_encoder dst_image;
+		if (!dst_image.init(&dst_stream, width, height, 3, comp_params))
+			return false;
+
+		if (!dst_image.process_yuv_image(image))
+			return false;
+
+		dst_image.deinit();
+
+		buf_size = dst_stream.get_size();
+		return true;
+	}
+
+	// The threads and encoders of a jpeg_batch_encoder. The threads sleep until compress_images() bumps m_batch_num,
+	// then take images off the batch until it's empty.
+	struct jpeg_batch_encoder::worker_pool
+	{
+		int m_num_threads;
+		std::thread* m_pThreads;
+		jpeg_encoder* m_pEncoders;
+		std::mutex m_mutex;
+		std::condition_variable m_start_cond, m_done_cond;
+		uint m_batch_num;
+		int m_num_busy;
+		bool m_exit_flag;
+
+		batch_image* m_pImages;
+		int m_num_images;
+		params m_params;
+		std::atomic<int> m_next_image;
+
+		void compress_batch(jpeg_encoder& encoder)
 		{
-			for (int i = 0; i < height; i++)
+			int image_index;
+			while ((image_index = m_next_image++) < m_num_images)
 			{
-				const uint8* pScanline = pImage_data + i * width * num_channels;
-				if (!dst_image.process_scanline(pScanline))
-					return false;
+				batch_image& image = m_pImages[image_index];
+				memory_stream dst_stream(image.m_pBuf, image.m_pBuf ? JPGE_MAX(image.m_buf_size, 0) : 0);
+				const int pitch = image.m_pitch ? image.m_pitch : image.m_width * image.m_num_channels;
+				image.m_status = encoder.init(&dst_stream, image.m_width, image.m_height, image.m_num_channels, m_params) && encoder.process_image(image.m_pImage_data, pitch);
+				image.m_buf_size = image.m_status ? dst_stream.get_size() : 0;
 			}
-			if (!dst_image.process_scanline(NULL))
-				return false;
 		}
 
-		dst_image.deinit();
+		void thread_func(int thread_index)
+		{
+			uint batch_num = 0;
+			for (; ; )
+			{
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					m_start_cond.wait(lock, [&] { return (m_exit_flag) || (m_batch_num != batch_num); });
+					if (m_exit_flag)
+						return;
+					batch_num = m_batch_num;
+				}
+				compress_batch(m_pEncoders[thread_index]);
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (--m_num_busy == 0)
+					m_done_cond.notify_one();
+			}
+		}
+	};
 
-		buf_size = dst_stream.get_size();
+	jpeg_batch_encoder::jpeg_batch_encoder() : m_pPool(NULL)
+	{
+	}
+
+	jpeg_batch_encoder::~jpeg_batch_encoder()
+	{
+		deinit();
+	}
+
+	bool jpeg_batch_encoder::init(int num_threads)
+	{
+		deinit();
+		if (num_threads < 1)
+			return false;
+		m_pPool = new worker_pool;
+		m_pPool->m_num_threads = num_threads;
+		m_pPool->m_pEncoders = new jpeg_encoder[num_threads];
+		m_pPool->m_batch_num = 0;
+		m_pPool->m_num_busy = 0;
+		m_pPool->m_exit_flag = false;
+		m_pPool->m_pImages = NULL;
+		m_pPool->m_num_images = 0;
+		m_pPool->m_pThreads = new std::thread[num_threads - 1];
+		for (int i = 0; i < num_threads - 1; i++)
+			m_pPool->m_pThreads[i] = std::thread(&worker_pool::thread_func, m_pPool, i + 1);
 		return true;
 	}
 
+	void jpeg_batch_encoder::deinit()
+	{
+		if (!m_pPool)
+			return;
+		{
+			std::lock_guard<std::mutex> lock(m_pPool->m_mutex);
+			m_pPool->m_exit_flag = true;
+		}
+		m_pPool->m_start_cond.notify_all();
+		for (int i = 0; i < m_pPool->m_num_threads - 1; i++)
+			m_pPool->m_pThreads[i].join();
+		delete[] m_pPool->m_pThreads;
+		delete[] m_pPool->m_pEncoders;
+		delete m_pPool;
+		m_pPool = NULL;
+	}
+
+	bool jpeg_batch_encoder::compress_images(batch_image* pImages, int num_images, const params& comp_params)
+	{
+		if ((!m_pPool) || (num_images < 0) || ((num_images) && (!pImages)))
+			return false;
+		worker_pool& pool = *m_pPool;
+		{
+			std::lock_guard<std::mutex> lock(pool.m_mutex);
+			pool.m_pImages = pImages;
+			pool.m_num_images = num_images;
+			pool.m_params = comp_params;
+			pool.m_params.m_num_threads = 0;
+			pool.m_params.m_pipeline_flag = false; // the pool's threads are busy with other images
+			pool.m_next_image = 0;
+			pool.m_num_busy = pool.m_num_threads - 1;
+			pool.m_batch_num++;
+		}
+		pool.m_start_cond.notify_all();
+		pool.compress_batch(pool.m_pEncoders[0]);
+		{
+			std::unique_lock<std::mutex> lock(pool.m_mutex);
+			pool.m_done_cond.wait(lock, [&] { return pool.m_num_busy == 0; });
+		}
+
+		bool status = true;
+		for (int i = 0; i < num_images; i++)
+			status = status && pImages[i].m_status;
+		return status;
+	}
+
 } // namespace jpge
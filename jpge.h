@@ -4,6 +4,8 @@
 #ifndef JPEG_ENCODER_H
 #define JPEG_ENCODER_H
 
+#include <stddef.h>
+
 namespace jpge
 {
 	typedef unsigned char  uint8;
@@ -12,19 +14,67 @@ namespace jpge
 	typedef unsigned short uint16;
 	typedef unsigned int   uint32;
 	typedef unsigned int   uint;
+	typedef unsigned long long uint64;
 
 	// JPEG chroma subsampling factors. Y_ONLY (grayscale images) and H2V2 (color images) are the most common.
 	enum subsampling_t { Y_ONLY = 0, H1V1 = 1, H2V1 = 2, H2V2 = 3 };
 
+	// Source pixel formats, naming the bytes of each pixel in memory order. A and X bytes are ignored.
+	// PF_DEFAULT is PF_Y, PF_RGB or PF_RGBA, depending on the number of source channels.
+	enum pixel_format_t
+	{
+		PF_DEFAULT = 0, PF_Y, PF_RGB, PF_BGR, PF_RGBA, PF_BGRA, PF_ARGB, PF_ABGR,
+		PF_RGBX = PF_RGBA, PF_BGRX = PF_BGRA, PF_XRGB = PF_ARGB, PF_XBGR = PF_ABGR
+	};
+
+	// Layouts of planar YCbCr images, see yuv_image.
+	enum yuv_format_t { YUV_I420 = 0, YUV_NV12, YUV_I422, YUV_I444 };
+
+	// A YCbCr image made of separate planes (e.g. from a video decoder), see jpeg_encoder::process_yuv_image().
+	// The chroma planes are half the width of the image for I420, NV12 and I422, and half the height for I420 and NV12
+	// (rounded up). NV12 has a single chroma plane of interleaved Cb, Cr pairs: m_pCb points to it and m_pCr is ignored.
+	// The pitches are the distances in bytes from one row to the next, and may be negative.
+	struct yuv_image
+	{
+		yuv_format_t m_format;
+		const uint8* m_pY;
+		const uint8* m_pCb;
+		const uint8* m_pCr;
+		int m_y_pitch, m_cb_pitch, m_cr_pitch;
+	};
+
+	// One scan of a progressive JPEG (see params::m_pScan_script), like libjpeg's jpeg_scan_info.
+	struct scan_info
+	{
+		// Number of components in the scan (1-3), and their indices (0=Y, 1=Cb, 2=Cr) in increasing order. AC scans must have 1 component.
+		int m_num_comps;
+		int m_comp_index[3];
+
+		// Spectral selection: the first and last coefficient coded by the scan, in zigzag order. DC scans are 0,0.
+		int m_Ss, m_Se;
+
+		// Successive approximation: the coefficients are sent shifted right by m_Al bits. m_Ah is 0 for the first scan of
+		// a coefficient, and the m_Al of its previous scan for refinement scans, which must have m_Al = m_Ah - 1.
+		int m_Ah, m_Al;
+	};
+
 	// JPEG compression parameters structure.
 	struct params
 	{
-		inline params() : m_quality(85), m_subsampling(H2V2), m_no_chroma_discrim_flag(false), m_two_pass_flag(false), m_use_std_tables(false) { }
+		inline params() : m_quality(85), m_subsampling(H2V2), m_no_chroma_discrim_flag(false), m_two_pass_flag(false), m_use_std_tables(false), m_num_threads(0), m_pipeline_flag(false), m_restart_interval(0), m_restart_per_mcu_row_flag(false), m_no_simd_flag(false), m_cache_coefficients_flag(false), m_huffman_sample_interval(0), m_progressive_flag(false), m_pScan_script(NULL), m_num_scans(0), m_pixel_format(PF_DEFAULT), m_output_buffer_size(0), m_flat_block_threshold(0), m_block_cache_size(0) { }
 
 		inline bool check() const
 		{
 			if ((m_quality < 1) || (m_quality > 100)) return false;
 			if ((uint)m_subsampling > (uint)H2V2) return false;
+			if (m_num_threads < 0) return false;
+			if ((m_restart_interval < 0) || (m_restart_interval > 65535)) return false;
+			if (m_huffman_sample_interval < 0) return false;
+			if ((m_pScan_script) && (m_num_scans < 1)) return false;
+			if ((uint)m_pixel_format > (uint)PF_ABGR) return false;
+			if (m_output_buffer_size < 0) return false;
+			if (m_flat_block_threshold < 0) return false;
+			if ((m_block_cache_size < 0) || (m_block_cache_size > 65536)) return false;
 			return true;
 		}
 
@@ -47,17 +97,108 @@ namespace jpge
 		// By default we use the same quantization tables as mozjpeg's default. 
 		// Set to true to use the traditional tables from JPEG Annex K.
 		bool m_use_std_tables;
+
+		// Number of threads used by jpeg_encoder::process_image(). 0 or 1 compresses on the calling thread.
+		// The image is split into horizontal bands of MCU rows which are coded in parallel and then stitched together,
+		// so the output is identical regardless of the thread count. The encoders of the bands are kept (like the other
+		// buffers, see jpeg_encoder::init()) for the next passes and images.
+		int m_num_threads;
+
+		// If true (and m_num_threads is 0 or 1), process_image() and process_yuv_image() use a second thread: it color
+		// converts, transforms and quantizes the MCU rows into a ring of a few rows, which the calling thread entropy codes.
+		// The output is identical. Ignored by progressive images, which are entropy coded after the whole image is loaded.
+		bool m_pipeline_flag;
+
+		// Restart interval in MCU's, 0 disables restart markers. Restart markers let decoders resynchronize after
+		// corrupted data, or decode the intervals in parallel.
+		int m_restart_interval;
+
+		// If true, each MCU row is its own restart interval (overrides m_restart_interval).
+		bool m_restart_per_mcu_row_flag;
+
+		// Disables the SSE2/AVX2 code paths - only intended for testing. The output is identical either way.
+		bool m_no_simd_flag;
+
+		// If true (with m_two_pass_flag), the first pass keeps the quantized coefficients in memory, and the second pass
+		// entropy codes them from there as soon as the first pass ends. The image only has to be supplied once
+		// (get_total_passes() returns 1). The cache takes 8 bytes per block, plus 2 bytes for each coefficient up to
+		// the last nonzero one in zag order.
+		bool m_cache_coefficients_flag;
+
+		// With m_two_pass_flag, the first pass only gathers Huffman statistics from one MCU row out of every N (0 or 1 uses every row).
+		// Symbols that don't appear in the sampled rows still get codes. Ignored if m_cache_coefficients_flag is true.
+		// Values around 4-8 give most of the size reduction of optimized tables on large images, for a fraction of the time.
+		int m_huffman_sample_interval;
+
+		// Writes a progressive JPEG (SOF2) instead of a baseline one. Every scan gets its own optimized Huffman tables, so
+		// m_two_pass_flag, m_cache_coefficients_flag and m_huffman_sample_interval are ignored, and the image only has to be
+		// supplied once. The quantized coefficients of the whole image are buffered until it's complete, in one allocation
+		// made by init(): 128 bytes per 8x8 block, so 2 bytes per pixel for Y_ONLY, 3 for H2V2, 4 for H2V1 and 6 for H1V1
+		// (with the image padded to whole MCU's).
+		bool m_progressive_flag;
+
+		// The scans of a progressive image (m_num_scans entries), or NULL to use the same default script as libjpeg.
+		// The array must stay valid until the image is compressed. init() fails if the script is invalid.
+		const scan_info* m_pScan_script;
+		int m_num_scans;
+
+		// Byte order of the source pixels. Its size must match the number of source channels (e.g. 4 for PF_BGRA).
+		// The channels are reordered as part of the color conversion, so no format is slower than RGB.
+		pixel_format_t m_pixel_format;
+
+		// Size in bytes of the buffer the entropy coded data is collected in before it's written to the output stream with
+		// put_buf(), 0 for the default (2KB). Larger buffers mean fewer writes, e.g. to files. Not used with streams that
+		// support output_stream::get_write_buffer().
+		int m_output_buffer_size;
+
+		// If > 0, 8x8 blocks whose samples span fewer than this many values (max - min < m_flat_block_threshold) skip the
+		// DCT and quantization, and are coded with just the DC coefficient of their mean. 1 only catches uniform blocks,
+		// which doesn't change the output. Larger values also flatten faint gradients and noise, losing that detail.
+		// Speeds up images with large uniform areas (documents, screenshots), and slightly slows down the others.
+		int m_flat_block_threshold;
+
+		// If > 0, the number of entries (rounded up to a power of 2, at most 65536) of a cache of recently transformed 8x8
+		// blocks. Blocks whose samples exactly match a cached one reuse its quantized coefficients instead of being
+		// transformed and quantized again, so the output doesn't change. Speeds up screen content with many repeated
+		// blocks (text, icons, tiled backgrounds), and slightly slows down images with few. Each entry takes 264 bytes,
+		// and each thread has its own cache. The cache is kept from one image to the next while the quantization tables
+		// don't change. See jpeg_encoder::get_block_cache_hits().
+		int m_block_cache_size;
 	};
 
 	// Writes JPEG image to a file. 
-	// num_channels must be 1 (Y) or 3 (RGB), image pitch must be width*num_channels.
+	// num_channels must be 1 (Y), 3 (RGB) or 4 (RGBA) (see params::m_pixel_format for other byte orders), image pitch must be width*num_channels.
 	bool compress_image_to_jpeg_file(const char* pFilename, int width, int height, int num_channels, const uint8* pImage_data, const params& comp_params = params());
 
+	// Same, but pitch is the distance in bytes from one scanline to the next, which may be more than width*num_channels
+	// (padded rows or a crop of a larger image), or negative for a bottom-up image. pImage_data points to the top scanline.
+	bool compress_image_to_jpeg_file(const char* pFilename, int width, int height, int num_channels, const uint8* pImage_data, int pitch, const params& comp_params = params());
+
 	// Writes JPEG image to memory buffer. 
 	// On entry, buf_size is the size of the output buffer pointed at by pBuf, which should be at least ~1024 bytes. 
 	// If return value is true, buf_size will be set to the size of the compressed data.
 	bool compress_image_to_jpeg_file_in_memory(void* pBuf, int& buf_size, int width, int height, int num_channels, const uint8* pImage_data, const params& comp_params = params());
 
+	// Same, with a pitch in bytes (see above).
+	bool compress_image_to_jpeg_file_in_memory(void* pBuf, int& buf_size, int width, int height, int num_channels, const uint8* pImage_data, int pitch, const params& comp_params = params());
+
+	// Returns an upper bound on the size of the JPEG file any width x height image can compress to with these params,
+	// or 0 if they're invalid. A buffer this large never makes compress_image_to_jpeg_file_in_memory() fail. The bound
+	// depends on the quality: the quantizers limit the size of the coefficients, but every byte of entropy coded data
+	// could still need a stuffed 0 byte, so it's several times what typical images need. See growable_memory_stream.
+	size_t get_max_compressed_size(int width, int height, int num_channels, const params& comp_params = params());
+
+	// Writes JPEG image to a memory buffer allocated with malloc(), which grows as needed. Returns the buffer (free it
+	// with free()) and sets buf_size to the size of the compressed data, or returns NULL on failure. A pitch of 0 means
+	// width*num_channels.
+	uint8* compress_image_to_jpeg_file_in_memory_alloc(int& buf_size, int width, int height, int num_channels, const uint8* pImage_data, int pitch = 0, const params& comp_params = params());
+
+	// Writes a planar YCbCr image to a file or memory buffer (see jpeg_encoder::process_yuv_image()).
+	bool compress_yuv_image_to_jpeg_file(const char* pFilename, int width, int height, const yuv_image& image, const params& comp_params = params());
+	bool compress_yuv_image_to_jpeg_file_in_memory(void* pBuf, int& buf_size, int width, int height, const yuv_image& image, const params& comp_params = params());
+
+	class band_stream;
+
 	// Output stream abstract class - used by the jpeg_encoder class to write to the output stream. 
 	// put_buf() is generally called with len==JPGE_OUT_BUF_SIZE bytes, but for headers it'll be called with smaller amounts.
 	class output_stream
@@ -66,6 +207,69 @@ namespace jpge
 		virtual ~output_stream() { };
 		virtual bool put_buf(const void* Pbuf, int len) = 0;
 		template<class T> inline bool put_obj(const T& obj) { return put_buf(&obj, sizeof(T)); }
+
+		// Optional zero-copy output: streams that write to memory can return a pointer to at least min_size writable
+		// bytes at the end of the stream (setting size to how many there are), so the entropy coded data is written
+		// straight into them instead of being copied by put_buf(). The encoder then calls commit() with the number of
+		// bytes it wrote there before it writes anything else. Returns NULL if unsupported (the default) or out of room.
+		virtual uint8* get_write_buffer(uint min_size, uint& size) { (void)min_size; size = 0; return NULL; }
+		virtual bool commit(uint size) { (void)size; return false; }
+	};
+
+	// Output stream writing to a buffer it allocates with malloc() and grows as needed (at least doubling each time).
+	class growable_memory_stream : public output_stream
+	{
+	public:
+		// initial_size is the size of the first allocation, made by the first write.
+		explicit growable_memory_stream(size_t initial_size = 4096);
+		virtual ~growable_memory_stream();
+
+		virtual bool put_buf(const void* pBuf, int len);
+		virtual uint8* get_write_buffer(uint min_size, uint& size);
+		virtual bool commit(uint size);
+
+		const uint8* get_buf() const { return m_pBuf; }
+		size_t get_size() const { return m_buf_ofs; }
+
+		// Returns the buffer (to be freed with free()), leaving the stream empty.
+		uint8* detach();
+
+		// Empties the stream, keeping its buffer.
+		void reset() { m_buf_ofs = 0; }
+
+	private:
+		growable_memory_stream(const growable_memory_stream&);
+		growable_memory_stream& operator =(const growable_memory_stream&);
+
+		uint8* m_pBuf;
+		size_t m_buf_size, m_buf_ofs, m_initial_size;
+	};
+
+	// Output stream writing to a file on a background thread, so compression and file I/O overlap. The data is collected
+	// in num_buffers buffers of buffer_size bytes each (written into directly, see get_write_buffer()). Full buffers are
+	// written by the thread while the encoder fills the next one, and the encoder only waits when all the others are
+	// still being written.
+	class async_file_stream : public output_stream
+	{
+	public:
+		async_file_stream();
+		virtual ~async_file_stream();
+
+		bool open(const char* pFilename, uint buffer_size = 1024 * 1024, uint num_buffers = 3);
+
+		// Writes out the rest of the data and closes the file. Returns false if any write failed.
+		bool close();
+
+		virtual bool put_buf(const void* pBuf, int len);
+		virtual uint8* get_write_buffer(uint min_size, uint& size);
+		virtual bool commit(uint size);
+
+	private:
+		async_file_stream(const async_file_stream&);
+		async_file_stream& operator =(const async_file_stream&);
+
+		struct file_writer;
+		file_writer* m_pWriter;
 	};
 
 	// Lower level jpeg_encoder class - useful if more control is needed than the above helper functions.
@@ -75,62 +279,147 @@ namespace jpge
 		jpeg_encoder();
 		~jpeg_encoder();
 
-		// Initializes the compressor.
+		// Initializes the compressor. May be called again to compress another image: the buffers are reused, growing if
+		// needed, and the quantization and default Huffman tables are only recomputed if the params they depend on change.
 		// pStream: The stream object to use for writing compressed data.
 		// params - Compression parameters structure, defined above.
 		// width, height  - Image dimensions.
-		// channels - May be 1, or 3. 1 indicates grayscale, 3 indicates RGB source data.
+		// src_channels - May be 1, 3 or 4. 1 indicates grayscale, 3 RGB and 4 RGBA source data, unless params::m_pixel_format says otherwise.
 		// Returns false on out of memory or if a stream write fails.
 		bool init(output_stream* pStream, int width, int height, int src_channels, const params& comp_params = params());
 
 		const params& get_params() const { return m_params; }
 
-		// Deinitializes the compressor, freeing any allocated memory. May be called at any time.
+		// Deinitializes the compressor, freeing any allocated memory (which init() doesn't). May be called at any time.
 		void deinit();
 
-		uint get_total_passes() const { return m_params.m_two_pass_flag ? 2 : 1; }
+		uint get_total_passes() const { return (m_params.m_two_pass_flag && !m_params.m_cache_coefficients_flag && !m_params.m_progressive_flag) ? 2 : 1; }
 		inline uint get_cur_pass() { return m_pass_num; }
 
 		// Call this method with each source scanline.
-		// width * src_channels bytes per scanline is expected (RGB or Y format).
+		// width * src_channels bytes per scanline is expected (in params::m_pixel_format).
 		// You must call with NULL after all scanlines are processed to finish compression.
 		// Returns false on out of memory or if a stream write fails.
 		bool process_scanline(const void* pScanline);
 
+		// Compresses an entire image (all passes) in one call, instead of calling process_scanline().
+		// Must be called right after init(). pImage_data must point to height scanlines of width * src_channels bytes.
+		// Uses params::m_num_threads threads.
+		// Returns false on out of memory or if a stream write fails.
+		bool process_image(const void* pImage_data);
+
+		// Same, but pImage_data's scanlines are pitch bytes apart (at least width * src_channels bytes, or negative for a
+		// bottom-up image, in which case pImage_data points to the top scanline).
+		bool process_image(const void* pImage_data, int pitch);
+
+		// Compresses an entire planar YCbCr image in one call, like process_image(), skipping the color conversion.
+		// The src_channels passed to init() doesn't matter. When the chroma planes match params::m_subsampling
+		// (I420 and NV12 with H2V2, I422 with H2V1, I444 with H1V1) or the output is Y_ONLY, the 8x8 blocks are read
+		// straight from the planes, otherwise the chroma is resampled.
+		bool process_yuv_image(const yuv_image& image);
+
+		// Compresses one frame of a sequence of same size frames that only change in places (e.g. screen captures), like
+		// process_image(), but only codes the restart intervals containing MCU's that overlap the rectangle of
+		// dirty_width x dirty_height pixels at (dirty_x, dirty_y). The coded data of the other intervals is copied from
+		// the previous frame, so the rest of the frame must be the same as it was then. The output is the same as
+		// process_image()'s. Needs restart intervals (params::m_restart_interval or m_restart_per_mcu_row_flag), and fails
+		// with two-pass or progressive images. Call init() before each frame as usual. The whole frame is coded if the
+		// previous one wasn't coded by process_dirty_image() with the same size and params. Runs on the calling thread.
+		bool process_dirty_image(const void* pImage_data, int pitch, int dirty_x, int dirty_y, int dirty_width, int dirty_height);
+
+		// Number of 8x8 blocks found in the block cache (see params::m_block_cache_size), and not found, since init().
+		// Summed over all the threads and passes. Their sum doesn't depend on the number of threads, but each thread has
+		// its own cache, so the hits depend on which thread coded which band. Blocks coded by
+		// params::m_flat_block_threshold aren't looked up.
+		uint get_block_cache_hits() const { return m_block_cache_hits; }
+		uint get_block_cache_misses() const { return m_block_cache_misses; }
+
 	private:
 		jpeg_encoder(const jpeg_encoder&);
 		jpeg_encoder& operator =(const jpeg_encoder&);
 
-		typedef int32 sample_array_t;
+		typedef int16 sample_array_t;
+		typedef void (*color_convert_func)(uint8* pY, uint8* pCb, uint8* pCr, const uint8* pSrc, int num_pixels);
+		struct mcu_band;
+		struct block_cache_entry;
+		struct frame_cache;
+
+		// What code_block() does with a quantized block: only update the DC predictor (see seed_dc_predictors()), gather
+		// statistics, write it, or store it to m_pCoeff_dst. The first three are the values of m_pass_num they're used in.
+		enum { BLOCK_DC_ONLY, BLOCK_PASS_ONE, BLOCK_PASS_TWO, BLOCK_STORE, NUM_BLOCK_MODES };
+		typedef void (jpeg_encoder::*code_mcus_func)(int first_mcu, int end_mcu);
 
 		output_stream* m_pStream;
 		params m_params;
 		uint8 m_num_components;
 		uint8 m_comp_h_samp[3], m_comp_v_samp[3];
-		int m_image_x, m_image_y, m_image_bpp, m_image_bpl;
+		int m_image_x, m_image_y, m_image_bpp, m_image_bpl, m_image_pitch;
 		int m_image_x_mcu, m_image_y_mcu;
-		int m_image_bpl_xlt, m_image_bpl_mcu;
+		int m_image_bpl_mcu;
 		int m_mcus_per_row;
 		int m_mcu_x, m_mcu_y;
-		uint8* m_mcu_lines[16];
+		uint8* m_mcu_lines[16]; // the Y, Cb and Cr samples of a line, m_image_x_mcu of each, one after the other
 		uint8 m_mcu_y_ofs;
 		sample_array_t m_sample_array[64];
 		int16 m_coefficient_array[64];
 		int32 m_quantization_tables[2][64];
+		uint16 m_quant_recip[2][64], m_quant_corr[2][64], m_quant_scale[2][64];
 		uint m_huff_codes[4][256];
 		uint8 m_huff_code_sizes[4][256];
 		uint8 m_huff_bits[4][17];
 		uint8 m_huff_val[4][256];
 		uint32 m_huff_count[4][256];
 		int m_last_dc_val[3];
-		enum { JPGE_OUT_BUF_SIZE = 2048 };
+		enum { JPGE_OUT_BUF_SIZE = 2048, JPGE_MAX_CORR_BITS = 1000, JPGE_MIN_WRITE_BUF_SIZE = 256, JPGE_HEADER_BUF_SIZE = 1536, JPGE_PIPELINE_ROWS = 4 };
 		uint8 m_out_buf[JPGE_OUT_BUF_SIZE];
+		uint8* m_pOut_buf_alloc;
+		uint m_out_buf_alloc_size;
+		uint8* m_pOut_buf_start;
 		uint8* m_pOut_buf;
 		uint m_out_buf_left;
-		uint32 m_bit_buffer;
+		bool m_out_buf_in_stream;
+		uint8 m_header_buf[JPGE_HEADER_BUF_SIZE];
+		uint m_header_size;
+		uint8 m_header_cache[JPGE_HEADER_BUF_SIZE];
+		uint m_header_cache_size;
+		int m_header_cache_key[6];
+		uint64 m_bit_buffer;
 		uint m_bits_in;
 		uint8 m_pass_num;
 		bool m_all_stream_writes_succeeded;
+		uint m_restart_interval;
+		uint m_restart_mcus_left;
+		uint m_restart_num;
+		int m_mcu_row;
+		int m_huff_sample_interval;
+		mcu_band* m_pBand;
+		color_convert_func m_pColor_convert;
+		code_mcus_func m_pCode_mcus[NUM_BLOCK_MODES];
+		bool m_has_sse2, m_has_avx2;
+		band_stream* m_pCoeff_cache;
+		int m_blocks_per_mcu;
+		int16* m_pCoeffs;
+		int16* m_pCoeff_dst;
+		size_t m_mcu_lines_size, m_coeffs_size;
+		int16* m_pCoeff_buf;
+		band_stream* m_pCoeff_cache_buf;
+		int m_quant_key;
+		bool m_std_huff_tables;
+		uint m_eob_run;
+		uint m_num_corr_bits;
+		uint8 m_corr_bits[JPGE_MAX_CORR_BITS];
+		const yuv_image* m_pYUV;
+		bool m_yuv_direct;
+		uint8 m_yuv_h_shift, m_yuv_v_shift;
+		int m_yuv_mcu_row;
+		block_cache_entry* m_pBlock_cache;
+		uint m_block_cache_size;
+		uint m_block_cache_hits, m_block_cache_misses;
+		frame_cache* m_pFrame_cache;
+		jpeg_encoder* m_pWorkers; // the band workers, or the pipeline's worker
+		int m_num_workers;
+		mcu_band* m_pBands;
+		int m_num_bands;
 
 		void optimize_huffman_table(int table_num, int table_len);
 		void emit_byte(uint8 i);
@@ -141,31 +430,119 @@ namespace jpge
 		void emit_sof();
 		void emit_dht(uint8* bits, uint8* val, int index, bool ac_flag);
 		void emit_dhts();
-		void emit_sos();
+		void emit_sos(const scan_info& scan);
+		void emit_dri();
 		void emit_markers();
+		void emit_header_markers();
+		void flush_header();
 		void compute_huffman_table(uint* codes, uint8* code_sizes, uint8* bits, uint8* val);
-		void compute_quant_table(int32* dst, int16* src);
+		void compute_quant_reciprocals(int table_num);
 		void adjust_quant_table(int32* dst, int32* src);
 		void first_pass_init();
 		bool second_pass_init();
 		bool jpg_open(int p_x_res, int p_y_res, int src_channels);
-		void load_block_8_8_grey(int x);
 		void load_block_8_8(int x, int y, int c);
 		void load_block_16_8(int x, int c);
 		void load_block_16_8_8(int x, int c);
 		void load_quantized_coefficients(int component_num);
+		bool quantize_flat_block(int component_num);
+		void quantize_block(int component_num);
+		void quantize_cached_block(int component_num);
 		void flush_output_buffer();
+		void next_output_buffer();
 		void put_bits(uint bits, uint len);
-		void code_coefficients_pass_one(int component_num);
-		void code_coefficients_pass_two(int component_num);
+		void put_buffered_bytes(uint num_bytes);
+		void put_marker_bytes(int marker);
+		void end_band_segment();
+		void emit_restart();
+		void check_restart();
+		void set_restart_state(int mcu_index);
+		void code_coefficients_pass_one(int component_num, const int16* pSrc, uint64 mask);
+		void code_coefficients_pass_two(int component_num, const int16* pSrc, uint64 mask);
+		template<int MODE> void code_coefficients(int component_num, const int16* pSrc);
+		template<int MODE> void code_block(int component_num);
 		void code_block(int component_num);
+		inline int get_block_mode() const { return m_pCoeff_dst ? static_cast<int>(BLOCK_STORE) : m_pass_num; }
+		template<int SUBSAMPLING, int MODE> void code_mcus(int first_mcu, int end_mcu);
+		template<int SUBSAMPLING> void select_code_mcus();
+		template<int MODE> void code_mcu_row_coefficients(const int16* pSrc);
+		void cache_coefficients(const int16* pSrc, uint64 mask);
+		void code_cached_coefficients();
+		void put_symbol(int table_num, uint sym);
+		void put_scan_bits(uint bits, uint len);
+		void put_correction_bits(const uint8* pBits, uint num_bits);
+		void put_eob_run(int table_num);
+		void code_progressive_block(const int16* pBlock, int component_num, const scan_info& scan);
+		void code_ac_refine(const int16* pBlock, int table_num, const scan_info& scan, uint64 mask);
+		void code_scan(const scan_info& scan);
+		bool code_progressive_scans();
 		void process_mcu_row();
+		bool skip_mcu_row(int mcu_row) const;
+		void smooth_huffman_counts();
 		bool terminate_pass_one();
 		bool terminate_pass_two();
 		bool process_end_of_image();
 		void load_mcu(const void* src);
+		void load_mcu_line(const uint8* pSrc, int y_ofs, int x_ofs);
+		void pad_mcu_line(uint8* pLine);
+		void load_yuv_mcu_line(int y, int y_ofs, int x_ofs);
+		void load_plane_block(const uint8* pPlane, int pitch, int step, int width, int height, int x, int y);
+		void process_yuv_mcus(int first_mcu, int end_mcu);
+		bool encode_image(const uint8* pImage);
+		void load_mcu_row(const uint8* pImage, int mcu_row);
+		void process_mcus(int first_mcu, int end_mcu);
+		void seed_dc_predictors(const uint8* pImage, int mcu_row);
+		jpeg_encoder* get_workers(int num_workers);
+		bool init_band_worker(const jpeg_encoder& parent);
+		void encode_band(const uint8* pImage, mcu_band& band);
+		void put_stuffed_bytes(const uint8* pBuf, uint num_bytes);
+		void put_raw_bits(const uint8* pBuf, uint num_bits);
+		bool process_image_bands(const uint8* pImage, int num_threads);
+		bool process_image_pipelined(const uint8* pImage);
 		void clear();
-		void init();
+		void reset();
+	};
+
+	// One image of a batch, see jpeg_batch_encoder.
+	struct batch_image
+	{
+		// The source image, as passed to compress_image_to_jpeg_file_in_memory(). A pitch of 0 means width * num_channels.
+		const uint8* m_pImage_data;
+		int m_width, m_height, m_num_channels, m_pitch;
+
+		// The output buffer. On entry m_buf_size is its size, on return the size of the compressed data (0 on failure).
+		void* m_pBuf;
+		int m_buf_size;
+
+		// Set on return to true if the image was compressed.
+		bool m_status;
+	};
+
+	// Compresses batches of images (e.g. thumbnails) to memory buffers on a pool of threads, each coding whole images
+	// with its own jpeg_encoder that's reused from one image to the next. Once the encoders' buffers have grown to fit
+	// the largest image, compress_images() doesn't allocate any memory.
+	class jpeg_batch_encoder
+	{
+	public:
+		jpeg_batch_encoder();
+		~jpeg_batch_encoder();
+
+		// Starts num_threads - 1 threads (the thread calling compress_images() is the last one).
+		bool init(int num_threads);
+
+		// Stops the threads and frees the encoders.
+		void deinit();
+
+		// Compresses num_images images, ignoring params::m_num_threads and m_pipeline_flag (each image is coded on a single
+		// thread of the pool). Returns true if all of them succeeded.
+		bool compress_images(batch_image* pImages, int num_images, const params& comp_params = params());
+
+	private:
+		jpeg_batch_encoder(const jpeg_batch_encoder&);
+		jpeg_batch_encoder& operator =(const jpeg_batch_encoder&);
+
+		struct worker_pool;
+		worker_pool* m_pPool;
 	};
 
 } // namespace jpge
@@ -36,13 +36,22 @@ static int print_usage()
 	printf("-glogfilename.txt: Append output to log file\n");
 	printf("\nOptions supported in compression mode (the default):\n");
 	printf("-o: Enable optimized Huffman tables (slower, but smaller files)\n");
+	printf("-oN: Enable optimized Huffman tables, gathering statistics from every Nth MCU row\n");
+	printf("-c: With -o, cache the coefficients in memory so the image is only compressed once\n");
+	printf("-p: Write a progressive JPEG\n");
 	printf("-luma: Output Y-only image\n");
 	printf("-h1v1, -h2v1, -h2v2: Chroma subsampling (default is either Y-only or H2V2)\n");
 	printf("-m: Test mem to mem compression (instead of mem to file)\n");
+	printf("-tN: Compress using N threads\n");
+	printf("-rN: Emit a restart marker every N MCU's (-r alone: one restart interval per MCU row)\n");
+	printf("-fN: Code 8x8 blocks whose samples span fewer than N values with just their DC coefficient (-f alone: N = 1, only uniform blocks)\n");
+	printf("-bN: Cache N recently transformed 8x8 blocks, and reuse their coefficients for repeated blocks (screen content)\n");
 	printf("-wfilename.tga: Write decompressed image to filename.tga\n");
 	printf("-s: Use stb_image.h to decompress JPEG image, instead of jpgd.cpp\n");
 	printf("-q: Use traditional JPEG Annex K quantization tables, instead of mozjpeg's default tables\n");
 	printf("-no_simd: Don't use SIMD instructions\n");
+	printf("-pipeline: Entropy code on a second thread, while the next MCU rows are transformed and quantized\n");
+	printf("-async: Write the JPEG file on a background thread (jpge::async_file_stream)\n");
 	printf("-box_filtering: Use box filtering for chroma, instead of linear (decompression only)\n");
 	printf("\nExample usages:\n");
 	printf("Test compression: jpge orig.png comp.jpg 90\n");
@@ -162,7 +171,543 @@ static void image_compare(image_compare_results& results, int width, int height,
 		results.peak_snr = log10(255.0f / results.root_mean_squared) * 20.0f;
 }
 
-// Simple exhaustive test. Tries compressing/decompressing image using all supported quality, subsampling, and Huffman optimization settings.
+// Decompresses the JPEG image in pBuf and compares it to the RGB image it was compressed from. Returns false if it can't
+// be decompressed or has the wrong size.
+static bool compare_jpeg_to_image(image_compare_results& results, const void* pBuf, int buf_size, int width, int height, const uint8* pImage_data, bool luma_only, bool use_jpgd)
+{
+	int uncomp_width = 0, uncomp_height = 0, uncomp_actual_comps = 0;
+	uint8* pUncomp_image_data;
+	if (use_jpgd)
+		pUncomp_image_data = jpgd::decompress_jpeg_image_from_memory(static_cast<const uint8*>(pBuf), buf_size, &uncomp_width, &uncomp_height, &uncomp_actual_comps, 3);
+	else
+		pUncomp_image_data = stbi_load_from_memory(static_cast<const stbi_uc*>(pBuf), buf_size, &uncomp_width, &uncomp_height, &uncomp_actual_comps, 3);
+	if (!pUncomp_image_data)
+		return false;
+	const bool status = (uncomp_width == width) && (uncomp_height == height);
+	if (status)
+		image_compare(results, width, height, pImage_data, 3, pUncomp_image_data, 3, luma_only);
+	free(pUncomp_image_data);
+	return status;
+}
+
+// Converts the RGB image to each planar YCbCr layout, compresses it with process_yuv_image() to every subsampling, and
+// checks that the decompressed image is about as close to the planes (converted back to RGB) as when that RGB image is
+// compressed with the same params. The pipeline (params::m_pipeline_flag) must give the same bytes as a single thread.
+static bool check_yuv_layouts(int width, int height, const uint8* pImage_data, bool use_jpgd)
+{
+	const int chroma_width = (width + 1) / 2, chroma_height = (height + 1) / 2;
+	uint8* pY = static_cast<uint8*>(malloc(width * height));
+	uint8* pCb444 = static_cast<uint8*>(malloc(width * height * 2)), * pCr444 = pCb444 + width * height;
+	uint8* pCb422 = static_cast<uint8*>(malloc(chroma_width * height * 2)), * pCr422 = pCb422 + chroma_width * height;
+	uint8* pCb420 = static_cast<uint8*>(malloc(chroma_width * chroma_height * 4)), * pCr420 = pCb420 + chroma_width * chroma_height, * pCbCr = pCr420 + chroma_width * chroma_height;
+	uint8* pPlanes_rgb = static_cast<uint8*>(malloc(width * height * 3));
+	int buf_size = width * height * 8 + 4096;
+	void* pBuf = malloc(buf_size);
+	void* pPipeline_buf = malloc(buf_size);
+
+	for (int i = 0; i < width * height; i++)
+	{
+		const int r = pImage_data[i * 3 + 0], g = pImage_data[i * 3 + 1], b = pImage_data[i * 3 + 2];
+		pY[i] = static_cast<uint8>((r * 19595 + g * 38470 + b * 7471 + 32768) >> 16);
+		pCb444[i] = static_cast<uint8>((r * -11059 + g * -21709 + b * 32768 + (128 << 16) + 32768) >> 16);
+		pCr444[i] = static_cast<uint8>((r * 32768 + g * -27439 + b * -5329 + (128 << 16) + 32768) >> 16);
+	}
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < chroma_width; x++)
+		{
+			const int x0 = x * 2, x1 = (x0 + 1 < width) ? (x0 + 1) : x0;
+			pCb422[y * chroma_width + x] = static_cast<uint8>((pCb444[y * width + x0] + pCb444[y * width + x1] + 1) >> 1);
+			pCr422[y * chroma_width + x] = static_cast<uint8>((pCr444[y * width + x0] + pCr444[y * width + x1] + 1) >> 1);
+		}
+	}
+	for (int y = 0; y < chroma_height; y++)
+	{
+		const int y0 = y * 2, y1 = (y0 + 1 < height) ? (y0 + 1) : y0;
+		for (int x = 0; x < chroma_width; x++)
+		{
+			const int cb = (pCb422[y0 * chroma_width + x] + pCb422[y1 * chroma_width + x] + 1) >> 1, cr = (pCr422[y0 * chroma_width + x] + pCr422[y1 * chroma_width + x] + 1) >> 1;
+			pCb420[y * chroma_width + x] = static_cast<uint8>(cb); pCr420[y * chroma_width + x] = static_cast<uint8>(cr);
+			pCbCr[(y * chroma_width + x) * 2 + 0] = static_cast<uint8>(cb); pCbCr[(y * chroma_width + x) * 2 + 1] = static_cast<uint8>(cr);
+		}
+	}
+
+	const jpge::yuv_image layouts[4] =
+	{
+		{ jpge::YUV_I420, pY, pCb420, pCr420, width, chroma_width, chroma_width },
+		{ jpge::YUV_NV12, pY, pCbCr, NULL, width, chroma_width * 2, 0 },
+		{ jpge::YUV_I422, pY, pCb422, pCr422, width, chroma_width, chroma_width },
+		{ jpge::YUV_I444, pY, pCb444, pCr444, width, width, width }
+	};
+	const char* layout_names[4] = { "I420", "NV12", "I422", "I444" };
+
+	bool status = true;
+	for (int i = 0; (i < 4) && (status); i++)
+	{
+		const jpge::yuv_image& layout = layouts[i];
+		const int h_shift = (layout.m_format != jpge::YUV_I444) ? 1 : 0, v_shift = (i < 2) ? 1 : 0, step = (layout.m_format == jpge::YUV_NV12) ? 2 : 1;
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				const int ofs = (y >> v_shift) * layout.m_cb_pitch + (x >> h_shift) * step;
+				const int luma = layout.m_pY[y * width + x], cb = layout.m_pCb[ofs] - 128, cr = ((step == 2) ? layout.m_pCb[ofs + 1] : layout.m_pCr[(y >> v_shift) * layout.m_cr_pitch + (x >> h_shift)]) - 128;
+				const int rgb[3] = { luma + ((91881 * cr + 32768) >> 16), luma - ((22554 * cb + 46802 * cr - 32768) >> 16), luma + ((116130 * cb + 32768) >> 16) };
+				for (int c = 0; c < 3; c++)
+					pPlanes_rgb[(y * width + x) * 3 + c] = static_cast<uint8>((rgb[c] < 0) ? 0 : ((rgb[c] > 255) ? 255 : rgb[c]));
+			}
+		}
+
+		for (int subsampling = jpge::Y_ONLY; (subsampling <= jpge::H2V2) && (status); subsampling++)
+		{
+			jpge::params params;
+			params.m_quality = 90;
+			params.m_subsampling = static_cast<jpge::subsampling_t>(subsampling);
+			// The Y plane is exact, so Y_ONLY images are compared to the original.
+			const bool luma_only = (subsampling == jpge::Y_ONLY);
+			const uint8* pRef_image = luma_only ? pImage_data : pPlanes_rgb;
+			image_compare_results yuv_results, rgb_results;
+			int size = buf_size;
+			status = jpge::compress_yuv_image_to_jpeg_file_in_memory(pBuf, size, width, height, layout, params) &&
+				compare_jpeg_to_image(yuv_results, pBuf, size, width, height, pRef_image, luma_only, use_jpgd);
+			params.m_pipeline_flag = true;
+			int pipeline_size = buf_size;
+			if ((status) && ((!jpge::compress_yuv_image_to_jpeg_file_in_memory(pPipeline_buf, pipeline_size, width, height, layout, params)) ||
+				(pipeline_size != size) || (memcmp(pPipeline_buf, pBuf, size) != 0)))
+			{
+				log_printf("Pipelined output of %s image differs!\n", layout_names[i]);
+				status = false;
+				break;
+			}
+			params.m_pipeline_flag = false;
+			size = buf_size;
+			status = status && jpge::compress_image_to_jpeg_file_in_memory(pBuf, size, width, height, 3, pRef_image, params) &&
+				compare_jpeg_to_image(rgb_results, pBuf, size, width, height, pRef_image, luma_only, use_jpgd);
+			if (!status)
+			{
+				log_printf("Failed compressing or decompressing %s image!\n", layout_names[i]);
+				break;
+			}
+			log_printf("%s, %i, PSNR: %3.3f, RGB PSNR: %3.3f\n", layout_names[i], subsampling, yuv_results.peak_snr, rgb_results.peak_snr);
+			status = (yuv_results.peak_snr >= rgb_results.peak_snr - 1.5f);
+		}
+	}
+
+	free(pY);
+	free(pCb444);
+	free(pCb422);
+	free(pCb420);
+	free(pPlanes_rgb);
+	free(pBuf);
+	free(pPipeline_buf);
+	return status;
+}
+
+// Fills pScans with a progressive scan script for num_comps components that splits the AC coefficients differently than
+// the default script, and refines every coefficient twice. Returns the number of scans.
+static int get_refinement_scan_script(jpge::scan_info* pScans, int num_comps)
+{
+	int num_scans = 0;
+	jpge::scan_info dc = { num_comps, { 0, 1, 2 }, 0, 0, 0, 1 };
+	pScans[num_scans++] = dc;
+	for (int c = 0; c < num_comps; c++)
+	{
+		const jpge::scan_info ac[2] = { { 1, { c }, 1, 9, 0, 2 }, { 1, { c }, 10, 63, 0, 2 } };
+		pScans[num_scans++] = ac[0];
+		pScans[num_scans++] = ac[1];
+	}
+	for (int c = 0; c < num_comps; c++)
+	{
+		const jpge::scan_info refine[2] = { { 1, { c }, 1, 63, 2, 1 }, { 1, { c }, 1, 63, 1, 0 } };
+		pScans[num_scans++] = refine[0];
+		pScans[num_scans++] = refine[1];
+	}
+	dc.m_Ah = 1; dc.m_Al = 0;
+	pScans[num_scans++] = dc;
+	return num_scans;
+}
+
+// Compresses an image whose scanlines are pitch bytes apart, and checks that the output matches the ref_size bytes at
+// pRef_buf. pDesc names the case in the error message.
+static bool check_same_output(const char* pDesc, const jpge::params& params, int width, int height, int num_comps, const uint8* pImage_data, int pitch,
+	const void* pRef_buf, int ref_size, void* pBuf, int buf_size)
+{
+	int size = buf_size;
+	if (!jpge::compress_image_to_jpeg_file_in_memory(pBuf, size, width, height, num_comps, pImage_data, pitch, params))
+	{
+		log_printf("Failed compressing image (%s)!\n", pDesc);
+		return false;
+	}
+	if ((size != ref_size) || (memcmp(pBuf, pRef_buf, size) != 0))
+	{
+		log_printf("Output differs from the reference (%s)!\n", pDesc);
+		return false;
+	}
+	return true;
+}
+
+// Checks that compressing with several threads, or with the pipeline (params::m_pipeline_flag), gives the same output as
+// on one thread. Tries the params' restart interval, a restart marker after every MCU and one per MCU row, and (for
+// two-pass images) a few Huffman statistics sample intervals (see params::m_huffman_sample_interval). pRef_buf and pBuf
+// must be buf_size bytes each.
+static bool check_thread_identity(jpge::params params, int width, int height, int num_comps, const uint8* pImage_data, void* pRef_buf, void* pBuf, int buf_size)
+{
+	const int restart_intervals[] = { params.m_restart_interval, 1, 0 }, sample_intervals[] = { 0, 2, 4 }, thread_counts[] = { 2, 3, 5 };
+	for (int r = 0; r < 3; r++)
+	{
+		params.m_restart_interval = restart_intervals[r];
+		params.m_restart_per_mcu_row_flag = (r == 2);
+		for (int i = 0; i < (params.m_two_pass_flag ? 3 : 1); i++)
+		{
+			params.m_huffman_sample_interval = sample_intervals[i];
+			params.m_num_threads = 0;
+			int ref_size = buf_size;
+			if (!jpge::compress_image_to_jpeg_file_in_memory(pRef_buf, ref_size, width, height, num_comps, pImage_data, params))
+				return false;
+			for (int j = 0; j < 3; j++)
+			{
+				params.m_num_threads = thread_counts[j];
+				int size = buf_size;
+				if (!jpge::compress_image_to_jpeg_file_in_memory(pBuf, size, width, height, num_comps, pImage_data, params))
+					return false;
+				if ((size != ref_size) || (memcmp(pBuf, pRef_buf, size) != 0))
+				{
+					log_printf("Output of %i threads differs from 1 thread (restart interval %i, per MCU row: %i, sample interval %i)!\n", thread_counts[j],
+						params.m_restart_interval, params.m_restart_per_mcu_row_flag, sample_intervals[i]);
+					return false;
+				}
+			}
+
+			params.m_num_threads = 0;
+			params.m_pipeline_flag = true;
+			const bool status = check_same_output("pipeline", params, width, height, num_comps, pImage_data, width * num_comps, pRef_buf, ref_size, pBuf, buf_size);
+			params.m_pipeline_flag = false;
+			if (!status)
+			{
+				log_printf("Restart interval %i, per MCU row: %i, sample interval %i\n", params.m_restart_interval, params.m_restart_per_mcu_row_flag, sample_intervals[i]);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Checks that a padded copy of the image, and a bottom-up one (negative pitch), compress to the same bytes as the
+// packed image, on one thread and on several.
+static bool check_pitch_identity(jpge::params params, int width, int height, int num_comps, const uint8* pImage_data, void* pRef_buf, void* pBuf, int buf_size)
+{
+	const int row_size = width * num_comps, padded_pitch = row_size + 13;
+	uint8* pPadded = static_cast<uint8*>(malloc(height * padded_pitch));
+	uint8* pBottom_up = static_cast<uint8*>(malloc(height * row_size));
+	for (int y = 0; y < height; y++)
+	{
+		memcpy(pPadded + y * padded_pitch, pImage_data + y * row_size, row_size);
+		memset(pPadded + y * padded_pitch + row_size, (y & 1) ? 0 : 255, padded_pitch - row_size);
+		memcpy(pBottom_up + (height - 1 - y) * row_size, pImage_data + y * row_size, row_size);
+	}
+
+	bool status = true;
+	for (int num_threads = 0; (num_threads <= 3) && (status); num_threads += 3)
+	{
+		params.m_num_threads = num_threads;
+		int ref_size = buf_size;
+		status = jpge::compress_image_to_jpeg_file_in_memory(pRef_buf, ref_size, width, height, num_comps, pImage_data, params) &&
+			check_same_output("padded pitch", params, width, height, num_comps, pPadded, padded_pitch, pRef_buf, ref_size, pBuf, buf_size) &&
+			check_same_output("negative pitch", params, width, height, num_comps, pBottom_up + (height - 1) * row_size, -row_size, pRef_buf, ref_size, pBuf, buf_size);
+	}
+	free(pPadded);
+	free(pBottom_up);
+	return status;
+}
+
+// Checks that the RGB image, reordered into each source pixel format (params::m_pixel_format), compresses to the same
+// bytes as the RGB image, with and without SIMD. The A/X bytes are filled with a pattern that must be ignored. PF_Y is
+// checked against a grayscale image with the default format.
+static bool check_pixel_formats(jpge::params params, int width, int height, const uint8* pImage_data, void* pRef_buf, void* pBuf, int buf_size)
+{
+	struct pixel_format_desc { jpge::pixel_format_t m_format; const char* m_pName; int m_num_comps, m_r, m_g, m_b, m_a; };
+	static const pixel_format_desc s_formats[] =
+	{
+		{ jpge::PF_RGB, "PF_RGB", 3, 0, 1, 2, -1 }, { jpge::PF_BGR, "PF_BGR", 3, 2, 1, 0, -1 }, { jpge::PF_DEFAULT, "PF_DEFAULT (RGBA)", 4, 0, 1, 2, 3 },
+		{ jpge::PF_RGBA, "PF_RGBA", 4, 0, 1, 2, 3 }, { jpge::PF_BGRA, "PF_BGRA", 4, 2, 1, 0, 3 }, { jpge::PF_ARGB, "PF_ARGB", 4, 1, 2, 3, 0 },
+		{ jpge::PF_ABGR, "PF_ABGR", 4, 3, 2, 1, 0 }
+	};
+	const int num_pixels = width * height;
+	uint8* pPixels = static_cast<uint8*>(malloc(num_pixels * 4));
+
+	params.m_pixel_format = jpge::PF_DEFAULT;
+	int ref_size = buf_size;
+	bool status = jpge::compress_image_to_jpeg_file_in_memory(pRef_buf, ref_size, width, height, 3, pImage_data, params);
+	for (uint f = 0; (f < sizeof(s_formats) / sizeof(s_formats[0])) && (status); f++)
+	{
+		const pixel_format_desc& desc = s_formats[f];
+		for (int i = 0; i < num_pixels; i++)
+		{
+			uint8* pDst = pPixels + i * desc.m_num_comps;
+			pDst[desc.m_r] = pImage_data[i * 3 + 0];
+			pDst[desc.m_g] = pImage_data[i * 3 + 1];
+			pDst[desc.m_b] = pImage_data[i * 3 + 2];
+			if (desc.m_a >= 0)
+				pDst[desc.m_a] = static_cast<uint8>(i * 37);
+		}
+		params.m_pixel_format = desc.m_format;
+		for (int no_simd = 0; (no_simd <= 1) && (status); no_simd++)
+		{
+			params.m_no_simd_flag = (no_simd != 0);
+			status = check_same_output(desc.m_pName, params, width, height, desc.m_num_comps, pPixels, width * desc.m_num_comps, pRef_buf, ref_size, pBuf, buf_size);
+		}
+	}
+
+	for (int i = 0; i < num_pixels; i++)
+		pPixels[i] = pImage_data[i * 3 + 1];
+	params.m_pixel_format = jpge::PF_DEFAULT;
+	params.m_no_simd_flag = false;
+	ref_size = buf_size;
+	status = status && jpge::compress_image_to_jpeg_file_in_memory(pRef_buf, ref_size, width, height, 1, pPixels, params);
+	params.m_pixel_format = jpge::PF_Y;
+	status = status && check_same_output("PF_Y", params, width, height, 1, pPixels, width, pRef_buf, ref_size, pBuf, buf_size);
+
+	free(pPixels);
+	return status;
+}
+
+// Checks params::m_flat_block_threshold: a threshold of 1 (uniform blocks only) must not change the output. The samples
+// of a block coded flat by a threshold of N span fewer than N values, so they're at most N - 1 away from their mean, and
+// under N/2 on average. So larger thresholds may only add N - 1 to the max error, and lower the PSNR to what adding N to
+// the RMS error (of 3 channels, see image_compare()) gives. Several threads must give the same bytes.
+static bool check_flat_blocks(jpge::params params, int width, int height, int num_comps, const uint8* pImage_data, void* pRef_buf, void* pBuf, int buf_size, bool use_jpgd)
+{
+	const bool luma_only = (params.m_subsampling == jpge::Y_ONLY);
+	int ref_size = buf_size;
+	image_compare_results ref_results;
+	if ((!jpge::compress_image_to_jpeg_file_in_memory(pRef_buf, ref_size, width, height, num_comps, pImage_data, params)) ||
+		(!compare_jpeg_to_image(ref_results, pRef_buf, ref_size, width, height, pImage_data, luma_only, use_jpgd)))
+		return false;
+
+	params.m_flat_block_threshold = 1;
+	if (!check_same_output("flat block threshold 1", params, width, height, num_comps, pImage_data, width * num_comps, pRef_buf, ref_size, pBuf, buf_size))
+		return false;
+
+	const int thresholds[] = { 4, 12 };
+	for (int i = 0; i < 2; i++)
+	{
+		params.m_flat_block_threshold = thresholds[i];
+		params.m_num_threads = 0;
+		ref_size = buf_size;
+		image_compare_results results;
+		if ((!jpge::compress_image_to_jpeg_file_in_memory(pRef_buf, ref_size, width, height, num_comps, pImage_data, params)) ||
+			(!compare_jpeg_to_image(results, pRef_buf, ref_size, width, height, pImage_data, luma_only, use_jpgd)))
+			return false;
+		const double min_psnr = log10(255.0f / (ref_results.root_mean_squared + thresholds[i])) * 20.0f;
+		if ((results.peak_snr < min_psnr) || (results.max_err > ref_results.max_err + thresholds[i] - 1))
+		{
+			log_printf("Flat block threshold %i: PSNR %3.3f (min %3.3f), max error %3.0f (was %3.0f)!\n", thresholds[i], results.peak_snr, min_psnr, results.max_err, ref_results.max_err);
+			return false;
+		}
+		params.m_num_threads = 3;
+		if (!check_same_output("flat blocks on 3 threads", params, width, height, num_comps, pImage_data, width * num_comps, pRef_buf, ref_size, pBuf, buf_size))
+			return false;
+	}
+	return true;
+}
+
+// Checks that the block cache (params::m_block_cache_size) doesn't change the output of an image whose right half repeats
+// its left half, with a few cache sizes, on several threads and with the pipeline. The number of blocks looked up in the
+// cache mustn't depend on the number of threads. An encoder that keeps its cache for the next images (with the same
+// quality and then another one) must code them as a new encoder would.
+static bool check_block_cache(jpge::params params, int width, int height, const uint8* pImage_data, void* pRef_buf, void* pBuf, int buf_size)
+{
+	const int pitch = width * 3, half = (width >= 32) ? ((width / 32) * 16) : width;
+	uint8* pTiled = static_cast<uint8*>(malloc(height * pitch));
+	for (int y = 0; y < height; y++)
+	{
+		memcpy(pTiled + y * pitch, pImage_data + y * pitch, half * 3);
+		for (int x = half; x < width; x += half)
+			memcpy(pTiled + y * pitch + x * 3, pImage_data + y * pitch, ((width - x < half) ? (width - x) : half) * 3);
+	}
+
+	params.m_block_cache_size = 0;
+	int ref_size = buf_size;
+	bool status = jpge::compress_image_to_jpeg_file_in_memory(pRef_buf, ref_size, width, height, 3, pTiled, params);
+	const int cache_sizes[] = { 1, 64, 4096 };
+	for (int i = 0; (i < 3) && (status); i++)
+	{
+		params.m_block_cache_size = cache_sizes[i];
+		for (int num_threads = 0; (num_threads <= 3) && (status); num_threads += 3)
+		{
+			params.m_num_threads = num_threads;
+			status = check_same_output("block cache", params, width, height, 3, pTiled, pitch, pRef_buf, ref_size, pBuf, buf_size);
+		}
+		params.m_num_threads = 0;
+		params.m_pipeline_flag = true;
+		status = status && check_same_output("block cache with pipeline", params, width, height, 3, pTiled, pitch, pRef_buf, ref_size, pBuf, buf_size);
+		params.m_pipeline_flag = false;
+	}
+
+	uint num_lookups[2] = { 0, 0 };
+	for (int i = 0; (i < 2) && (status); i++)
+	{
+		params.m_num_threads = i * 3;
+		jpge::jpeg_encoder encoder;
+		jpge::growable_memory_stream stream;
+		status = encoder.init(&stream, width, height, 3, params) && encoder.process_image(pTiled);
+		num_lookups[i] = encoder.get_block_cache_hits() + encoder.get_block_cache_misses();
+	}
+	params.m_num_threads = 0;
+	if ((status) && (num_lookups[0] != num_lookups[1]))
+	{
+		log_printf("Block cache lookups on 1 thread (%u) and 3 threads (%u) differ!\n", num_lookups[0], num_lookups[1]);
+		status = false;
+	}
+
+	jpge::jpeg_encoder encoder;
+	jpge::growable_memory_stream stream;
+	const int qualities[] = { params.m_quality, params.m_quality, (params.m_quality > 50) ? 20 : 80 };
+	for (int i = 0; (i < 3) && (status); i++)
+	{
+		params.m_quality = qualities[i];
+		params.m_block_cache_size = 0;
+		ref_size = buf_size;
+		status = jpge::compress_image_to_jpeg_file_in_memory(pRef_buf, ref_size, width, height, 3, pTiled, params);
+		params.m_block_cache_size = 64;
+		stream.reset();
+		status = status && encoder.init(&stream, width, height, 3, params) && encoder.process_image(pTiled);
+		if ((status) && ((stream.get_size() != static_cast<size_t>(ref_size)) || (memcmp(stream.get_buf(), pRef_buf, ref_size) != 0) || ((half < width) && (!encoder.get_block_cache_hits()))))
+		{
+			log_printf("Output of an encoder reusing its block cache differs, or had no cache hits (image %i)!\n", i);
+			status = false;
+		}
+	}
+
+	free(pTiled);
+	return status;
+}
+
+// Compresses an image to a file through a jpge::async_file_stream. The stream is left to the destructor to close if
+// close_stream is false.
+static bool compress_image_to_jpeg_file_async(const char* pFilename, int width, int height, int num_comps, const uint8* pImage_data, const jpge::params& params,
+	uint buffer_size = 1024 * 1024, uint num_buffers = 3, bool close_stream = true)
+{
+	jpge::async_file_stream dst_stream;
+	if (!dst_stream.open(pFilename, buffer_size, num_buffers))
+		return false;
+
+	jpge::jpeg_encoder dst_image;
+	if ((!dst_image.init(&dst_stream, width, height, num_comps, params)) || (!dst_image.process_image(pImage_data)))
+		return false;
+
+	dst_image.deinit();
+
+	return close_stream ? dst_stream.close() : true;
+}
+
+// Checks that async_file_stream writes the same bytes as an in-memory stream, using buffers small enough to make the
+// encoder wait on the writer thread, and that failing to create or write the file is reported.
+static bool check_async_file_stream(const char* pSrc_filename, int width, int height, int num_comps, const uint8* pImage_data, void* pRef_buf, void* pBuf, int buf_size)
+{
+	char filename[512];
+	snprintf(filename, sizeof(filename), "%s.async_test.jpg", pSrc_filename);
+
+	bool status = true;
+	for (uint test_index = 0; (test_index < 6) && (status); test_index++)
+	{
+		jpge::params params;
+		params.m_quality = (test_index & 1) ? 90 : 50;
+		params.m_num_threads = (test_index >= 2) ? 3 : 0;
+		params.m_progressive_flag = (test_index >= 4);
+
+		int ref_size = buf_size;
+		if (!jpge::compress_image_to_jpeg_file_in_memory(pRef_buf, ref_size, width, height, num_comps, pImage_data, params))
+			return false;
+
+		// 256 bytes is the smallest buffer the encoder writes into. Odd tests close the stream from its destructor.
+		const uint buffer_size = (test_index & 2) ? (1024 * 1024) : 256, num_buffers = (test_index & 2) ? 3 : 2;
+		status = compress_image_to_jpeg_file_async(filename, width, height, num_comps, pImage_data, params, buffer_size, num_buffers, (test_index & 1) == 0);
+
+		FILE* pFile = status ? fopen(filename, "rb") : NULL;
+		const int file_size = pFile ? (int)get_file_size(filename) : 0;
+		status = (pFile) && (file_size == ref_size) && (fread(pBuf, file_size, 1, pFile) == 1) && (memcmp(pBuf, pRef_buf, ref_size) == 0);
+		if (pFile)
+			fclose(pFile);
+		remove(filename);
+		if (!status)
+			log_printf("async_file_stream output differs from memory stream output (test %u)!\n", test_index);
+	}
+
+	jpge::async_file_stream bad_stream;
+	snprintf(filename, sizeof(filename), "%s.missing_dir/async_test.jpg", pSrc_filename);
+	if ((status) && ((bad_stream.open(filename)) || (bad_stream.close())))
+	{
+		log_printf("async_file_stream opened a file in a missing directory!\n");
+		status = false;
+	}
+
+#ifndef _WIN32
+	// Writes to /dev/full fail with ENOSPC.
+	FILE* pFull = fopen("/dev/full", "wb");
+	if ((status) && (pFull))
+	{
+		fclose(pFull);
+		if (compress_image_to_jpeg_file_async("/dev/full", width, height, num_comps, pImage_data, jpge::params(), 256, 2))
+		{
+			log_printf("async_file_stream didn't report a failed write!\n");
+			status = false;
+		}
+	}
+	else if (pFull)
+		fclose(pFull);
+#endif
+
+	return status;
+}
+
+// Checks that process_dirty_image() gives the same output as process_image() over a sequence of frames, each of which
+// inverts a different rectangle of the last one. The restart interval and quality change along the way, which makes
+// process_dirty_image() code a whole frame again.
+static bool check_dirty_frames(int width, int height, int num_comps, const uint8* pImage_data)
+{
+	const int pitch = width * num_comps;
+	uint8* pFrame = static_cast<uint8*>(malloc(height * pitch));
+	memcpy(pFrame, pImage_data, height * pitch);
+	jpge::growable_memory_stream dirty_stream, full_stream;
+	jpge::jpeg_encoder dirty_encoder, full_encoder;
+	bool status = true;
+	for (int frame = 0; (frame < 16) && (status); frame++)
+	{
+		jpge::params params;
+		params.m_quality = (frame < 12) ? 75 : 40;
+		params.m_restart_per_mcu_row_flag = (frame < 6);
+		params.m_restart_interval = 2;
+
+		// Frame 0 changes everything, frame 3 nothing.
+		int rect_x = (frame * 37) % width - 3, rect_y = (frame * 53) % height - 3, rect_width = width / 3 + 1, rect_height = height / 4 + 1;
+		if (!frame)
+		{
+			rect_x = rect_y = 0; rect_width = width; rect_height = height;
+		}
+		else if (frame == 3)
+			rect_width = 0;
+		const int x0 = (rect_x < 0) ? 0 : rect_x, x1 = (rect_x + rect_width > width) ? width : (rect_x + rect_width);
+		const int y0 = (rect_y < 0) ? 0 : rect_y, y1 = (rect_y + rect_height > height) ? height : (rect_y + rect_height);
+		for (int y = y0; y < y1; y++)
+			for (int x = x0 * num_comps; x < x1 * num_comps; x++)
+				pFrame[y * pitch + x] = 255 - pFrame[y * pitch + x];
+
+		dirty_stream.reset();
+		full_stream.reset();
+		status = dirty_encoder.init(&dirty_stream, width, height, num_comps, params) && dirty_encoder.process_dirty_image(pFrame, pitch, rect_x, rect_y, rect_width, rect_height) &&
+			full_encoder.init(&full_stream, width, height, num_comps, params) && full_encoder.process_image(pFrame);
+		if ((status) && ((dirty_stream.get_size() != full_stream.get_size()) || (memcmp(dirty_stream.get_buf(), full_stream.get_buf(), full_stream.get_size()) != 0)))
+		{
+			log_printf("Output of process_dirty_image() differs from process_image() (frame %i)!\n", frame);
+			status = false;
+		}
+	}
+	free(pFrame);
+	return status;
+}
+
+// Simple exhaustive test. Tries compressing/decompressing image using all supported quality, subsampling, Huffman optimization and progressive settings.
 static int exhausive_compression_test(const char* pSrc_filename, bool use_jpgd)
 {
 	int status = EXIT_SUCCESS;
@@ -179,9 +724,13 @@ static int exhausive_compression_test(const char* pSrc_filename, bool use_jpgd)
 
 	log_printf("Source file: \"%s\" Image resolution: %ix%i Actual comps: %i\n", pSrc_filename, width, height, actual_comps);
 
-	int orig_buf_size = width * height * 3; // allocate a buffer that's hopefully big enough (this is way overkill for jpeg)
-	if (orig_buf_size < 1024) orig_buf_size = 1024;
+	// Allocate a buffer big enough for the largest output of the test (quality 100, no chroma subsampling).
+	jpge::params max_params;
+	max_params.m_quality = 100;
+	max_params.m_subsampling = jpge::H1V1;
+	int orig_buf_size = static_cast<int>(jpge::get_max_compressed_size(width, height, req_comps, max_params));
 	void* pBuf = malloc(orig_buf_size);
+	void* pThread_bufs[2] = { malloc(orig_buf_size), malloc(orig_buf_size) };
 
 	uint8* pUncomp_image_data = NULL;
 
@@ -196,13 +745,23 @@ static int exhausive_compression_test(const char* pSrc_filename, bool use_jpgd)
 	{
 		for (uint subsampling = 0; subsampling <= jpge::H2V2; subsampling++)
 		{
-			for (uint optimize_huffman_tables = 0; optimize_huffman_tables <= 1; optimize_huffman_tables++)
+			// 0 = default Huffman tables, 1 = optimized Huffman tables, 2 = progressive. All three decode to the same image.
+			for (uint coding_mode = 0; coding_mode <= 2; coding_mode++)
 			{
-				// Fill in the compression parameter structure.
+				// Fill in the compression parameter structure. Every other quality uses restart intervals, and every third
+				// progressive image a custom scan script.
 				jpge::params params;
 				params.m_quality = quality_factor;
 				params.m_subsampling = static_cast<jpge::subsampling_t>(subsampling);
-				params.m_two_pass_flag = (optimize_huffman_tables != 0);
+				params.m_two_pass_flag = (coding_mode == 1);
+				params.m_progressive_flag = (coding_mode == 2);
+				params.m_restart_interval = (quality_factor & 1) ? 0 : 3;
+				jpge::scan_info scans[16];
+				if ((params.m_progressive_flag) && (quality_factor % 3 == 0))
+				{
+					params.m_pScan_script = scans;
+					params.m_num_scans = get_refinement_scan_script(scans, (subsampling == jpge::Y_ONLY) ? 1 : 3);
+				}
 
 				int comp_size = orig_buf_size;
 				if (!jpge::compress_image_to_jpeg_file_in_memory(pBuf, comp_size, width, height, req_comps, pImage_data, params))
@@ -211,6 +770,18 @@ static int exhausive_compression_test(const char* pSrc_filename, bool use_jpgd)
 					goto failure;
 				}
 
+				// The output must not depend on the number of threads (with any restart interval or sampled Huffman statistics),
+				// or on the image's pitch, pixel format and block cache. Flat blocks may only cost a little quality.
+				if ((!check_thread_identity(params, width, height, req_comps, pImage_data, pThread_bufs[0], pThread_bufs[1], orig_buf_size)) ||
+					(!check_pitch_identity(params, width, height, req_comps, pImage_data, pThread_bufs[0], pThread_bufs[1], orig_buf_size)) ||
+					(!check_pixel_formats(params, width, height, pImage_data, pThread_bufs[0], pThread_bufs[1], orig_buf_size)) ||
+					(!check_flat_blocks(params, width, height, req_comps, pImage_data, pThread_bufs[0], pThread_bufs[1], orig_buf_size, use_jpgd)) ||
+					(!check_block_cache(params, width, height, pImage_data, pThread_bufs[0], pThread_bufs[1], orig_buf_size)))
+				{
+					status = EXIT_FAILURE;
+					goto failure;
+				}
+
 				int uncomp_width = 0, uncomp_height = 0, uncomp_actual_comps = 0, uncomp_req_comps = 3;
 				free(pUncomp_image_data);
 				if (use_jpgd)
@@ -231,8 +802,8 @@ static int exhausive_compression_test(const char* pSrc_filename, bool use_jpgd)
 
 				image_compare_results results;
 				image_compare(results, width, height, pImage_data, req_comps, pUncomp_image_data, uncomp_req_comps, (params.m_subsampling == jpge::Y_ONLY) || (actual_comps == 1) || (uncomp_actual_comps == 1));
-				//log_printf("Q: %3u, S: %u, O: %u, CompSize: %7u, Error Max: %3.3f, Mean: %3.3f, Mean^2: %5.3f, RMSE: %3.3f, PSNR: %3.3f\n", quality_factor, subsampling, optimize_huffman_tables, comp_size, results.max_err, results.mean, results.mean_squared, results.root_mean_squared, results.peak_snr);
-				log_printf("%3u, %u, %u, %7u, %3.3f, %3.3f, %5.3f, %3.3f, %3.3f\n", quality_factor, subsampling, optimize_huffman_tables, comp_size, results.max_err, results.mean, results.mean_squared, results.root_mean_squared, results.peak_snr);
+				//log_printf("Q: %3u, S: %u, M: %u, CompSize: %7u, Error Max: %3.3f, Mean: %3.3f, Mean^2: %5.3f, RMSE: %3.3f, PSNR: %3.3f\n", quality_factor, subsampling, coding_mode, comp_size, results.max_err, results.mean, results.mean_squared, results.root_mean_squared, results.peak_snr);
+				log_printf("%3u, %u, %u, %7u, %3.3f, %3.3f, %5.3f, %3.3f, %3.3f\n", quality_factor, subsampling, coding_mode, comp_size, results.max_err, results.mean, results.mean_squared, results.root_mean_squared, results.peak_snr);
 				if (results.max_err > max_err) max_err = results.max_err;
 				if (results.peak_snr < lowest_psnr) lowest_psnr = results.peak_snr;
 
@@ -251,7 +822,7 @@ static int exhausive_compression_test(const char* pSrc_filename, bool use_jpgd)
 						status = EXIT_FAILURE;
 						goto failure;
 					}
-					if (optimize_huffman_tables)
+					if (coding_mode)
 					{
 						if ((prev_results.max_err != results.max_err) || (prev_results.peak_snr != results.peak_snr))
 						{
@@ -266,11 +837,20 @@ static int exhausive_compression_test(const char* pSrc_filename, bool use_jpgd)
 		}
 	}
 
+	if ((!check_dirty_frames(width, height, req_comps, pImage_data)) || (!check_yuv_layouts(width, height, pImage_data, use_jpgd)) ||
+		(!check_async_file_stream(pSrc_filename, width, height, req_comps, pImage_data, pThread_bufs[0], pThread_bufs[1], orig_buf_size)))
+	{
+		status = EXIT_FAILURE;
+		goto failure;
+	}
+
 	log_printf("Max error: %f Lowest PSNR: %f\n", max_err, lowest_psnr);
 
 failure:
 	free(pImage_data);
 	free(pBuf);
+	free(pThread_bufs[0]);
+	free(pThread_bufs[1]);
 	free(pUncomp_image_data);
 
 	log_printf((status == EXIT_SUCCESS) ? "Success.\n" : "Exhaustive test failed!\n");
@@ -349,13 +929,23 @@ int main(int arg_c, char* ppArgs[])
 	bool run_exhausive_test = false;
 	bool test_memory_compression = false;
 	bool optimize_huffman_tables = false;
+	bool cache_coefficients = false;
+	int huffman_sample_interval = 0;
+	bool progressive = false;
 	int subsampling = -1;
 	char output_filename[256] = "";
 	bool use_jpgd = true;
 	bool test_jpgd_decompression = false;
 	bool use_traditional_quant_tables = false;
 	bool no_simd = false;
+	bool pipeline = false;
+	bool async_output = false;
 	bool box_filtering = false;
+	int num_threads = 0;
+	int restart_interval = 0;
+	int flat_block_threshold = 0;
+	int block_cache_size = 0;
+	bool restart_per_mcu_row = false;
 
 	int arg_index = 1;
 	while ((arg_index < arg_c) && (ppArgs[arg_index][0] == '-'))
@@ -368,6 +958,14 @@ int main(int arg_c, char* ppArgs[])
 		{
 			box_filtering = true;
 		}
+		else if (strcasecmp(ppArgs[arg_index], "-pipeline") == 0)
+		{
+			pipeline = true;
+		}
+		else if (strcasecmp(ppArgs[arg_index], "-async") == 0)
+		{
+			async_output = true;
+		}
 		else
 		{
 			switch (tolower(ppArgs[arg_index][1]))
@@ -384,8 +982,28 @@ int main(int arg_c, char* ppArgs[])
 			case 'm':
 				test_memory_compression = true;
 				break;
+			case 't':
+				num_threads = atoi(&ppArgs[arg_index][2]);
+				break;
+			case 'r':
+				restart_interval = atoi(&ppArgs[arg_index][2]);
+				restart_per_mcu_row = (ppArgs[arg_index][2] == '\0');
+				break;
+			case 'f':
+				flat_block_threshold = (ppArgs[arg_index][2] == '\0') ? 1 : atoi(&ppArgs[arg_index][2]);
+				break;
+			case 'b':
+				block_cache_size = atoi(&ppArgs[arg_index][2]);
+				break;
 			case 'o':
 				optimize_huffman_tables = true;
+				huffman_sample_interval = atoi(&ppArgs[arg_index][2]);
+				break;
+			case 'c':
+				cache_coefficients = true;
+				break;
+			case 'p':
+				progressive = true;
 				break;
 			case 'l':
 				if (strcasecmp(&ppArgs[arg_index][1], "luma") == 0)
@@ -491,6 +1109,16 @@ int main(int arg_c, char* ppArgs[])
 	params.m_subsampling = (subsampling < 0) ? ((actual_comps == 1) ? jpge::Y_ONLY : jpge::H2V2) : static_cast<jpge::subsampling_t>(subsampling);
 	params.m_two_pass_flag = optimize_huffman_tables;
 	params.m_use_std_tables = use_traditional_quant_tables;
+	params.m_num_threads = num_threads;
+	params.m_pipeline_flag = pipeline;
+	params.m_restart_interval = restart_interval;
+	params.m_restart_per_mcu_row_flag = restart_per_mcu_row;
+	params.m_no_simd_flag = no_simd;
+	params.m_cache_coefficients_flag = cache_coefficients;
+	params.m_huffman_sample_interval = huffman_sample_interval;
+	params.m_flat_block_threshold = flat_block_threshold;
+	params.m_block_cache_size = block_cache_size;
+	params.m_progressive_flag = progressive;
 
 	log_printf("Writing JPEG image to file: %s\n", pDst_filename);
 
@@ -499,12 +1127,11 @@ int main(int arg_c, char* ppArgs[])
 	// Now create the JPEG file.
 	if (test_memory_compression)
 	{
-		int buf_size = width * height * 3; // allocate a buffer that's hopefully big enough (this is way overkill for jpeg)
-		if (buf_size < 1024) buf_size = 1024;
-		void* pBuf = malloc(buf_size);
+		int buf_size = 0;
 
 		tm.start();
-		if (!jpge::compress_image_to_jpeg_file_in_memory(pBuf, buf_size, width, height, req_comps, pImage_data, params))
+		uint8* pBuf = jpge::compress_image_to_jpeg_file_in_memory_alloc(buf_size, width, height, req_comps, pImage_data, 0, params);
+		if (!pBuf)
 		{
 			log_printf("Failed creating JPEG data!\n");
 			return EXIT_FAILURE;
@@ -529,6 +1156,19 @@ int main(int arg_c, char* ppArgs[])
 			log_printf("Failed writing to output file!\n");
 			return EXIT_FAILURE;
 		}
+
+		free(pBuf);
+	}
+	else if (async_output)
+	{
+		tm.start();
+
+		if (!compress_image_to_jpeg_file_async(pDst_filename, width, height, req_comps, pImage_data, params))
+		{
+			log_printf("Failed writing to output file!\n");
+			return EXIT_FAILURE;
+		}
+		tm.stop();
 	}
 	else
 	{